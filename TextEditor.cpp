@@ -1,8 +1,16 @@
 #include <algorithm>
-#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <string>
 #include <regex>
 #include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <cstddef>
+#include <functional>
+#include <limits>
 
 #include "TextEditor.h"
 
@@ -27,10 +35,49 @@ bool equals(InputIt1 first1, InputIt1 last1,
 	return first1 == last1 && first2 == last2;
 }
 
+static uint64_t HashCombine(uint64_t aSeed, uint64_t aValue)
+{
+	return aSeed ^ (aValue + 0x9e3779b97f4a7c15ull + (aSeed << 6) + (aSeed >> 2));
+}
+
+static uint64_t HashFloat(float aValue)
+{
+	uint32_t bits;
+	memcpy(&bits, &aValue, sizeof(bits));
+	return bits;
+}
+
+static uint64_t HashDouble(double aValue)
+{
+	uint64_t bits;
+	memcpy(&bits, &aValue, sizeof(bits));
+	return bits;
+}
+
+template <> float TextEditor::TextDistanceToLineStart<true>(const Coordinates& aFrom) const;
+template <> int TextEditor::ScreenPosToColumn<true>(int aLine, float aX) const;
+
 TextEditor::TextEditor()
 	: mLineSpacing(1.0f)
-	, mUndoIndex(0)
+	, mUndoBase(0)
+	, mUndoNode(-1)
+	, mUndoRootRedoChild(-1)
+	, mUndoMemory(0)
+	, mUndoMemoryLimit(64 * 1024 * 1024)
+	, mUndoMergeInterval(1.0)
+	, mUndoMergeDeadline(-DBL_MAX)
+	, mUndoBatch(nullptr)
+	, mUndoJumping(false)
+	, mUndoJumpColorFirst(0)
+	, mUndoJumpColorTail(0)
+	, mEditDepth(0)
+	, mInsertChunkSize(0)
+	, mInsertOffset(0)
+	, mInsertUndo(false)
 	, mTabSize(4)
+	, mLineLengthLimit(0)
+	, mFontPitch(FontPitch::Auto)
+	, mFixedPitch(false)
 	, mOverwrite(false)
 	, mReadOnly(false)
 	, mWithinRender(false)
@@ -45,16 +92,47 @@ TextEditor::TextEditor()
 	, mColorRangeMax(0)
 	, mSelectionMode(SelectionMode::Normal)
 	, mCheckComments(true)
+	, mMarkersRevision(0)
+	, mGlyphAdvances(nullptr)
+	, mPaletteRevision(0)
+	, mDiagnosticsProvider(nullptr)
+	, mDiagnosticsDebounce(0.5)
+	, mDiagnosticsDueTime(DBL_MAX)
+	, mDiagnosticsRunning(false)
+	, mTextVersion(0)
+	, mTextRevision(0)
+	, mFindMatchCase(true)
+	, mFindRevision(0)
+	, mFindLineCount(0)
+	, mFindChangesRevision(0)
+	, mFindChangedFirst(std::numeric_limits<int>::max())
+	, mFindUnchangedTail(std::numeric_limits<int>::max())
+	, mLineWidthsAdvances(nullptr)
+	, mLineWidthsTabSize(0)
+	, mLineWidthsLengthLimit(0)
 	, mLastClick(-1.0f)
 	, mHandleKeyboardInputs(true)
 	, mHandleMouseInputs(true)
 	, mIgnoreImGuiChild(false)
 	, mShowWhitespaces(true)
-	, mStartTime(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+	, mStartTime(0.0)
+	, mBlinkDeadline(DBL_MAX)
+	, mScrollRequested(false)
+	, mScrollY(0.0)
+	, mImGuiScrollY(0.0f)
+	, mScrollHeight(0.0f)
+	, mContentTopY(0.0f)
+	, mRenderedFirstLine(0)
+	, mRenderedLastLine(-1)
+	, mRenderedStateSignature(0)
+	, mFrameSignature(0)
+	, mFrameUnchanged(false)
 {
 	SetPalette(GetColorPalette());
 	SetLanguageDefinition(LanguageDefinition::HLSL());
+	mMarkerSlots.resize(1);
 	mLines.push_back(Line());
+	mLineWidths.Reset(1);
 }
 
 TextEditor::~TextEditor()
@@ -76,43 +154,59 @@ void TextEditor::SetLanguageDefinition(const LanguageDefinition & aLanguageDef)
 void TextEditor::SetPalette(const Palette & aValue)
 {
 	mPaletteBase = aValue;
+
+	// Palettes written before the diagnostic colors existed leave them zero, which would be transparent
+	for (int i = (int)PaletteIndex::DiagnosticError; i <= (int)PaletteIndex::DiagnosticInfo; ++i)
+	{
+		if (mPaletteBase[i] == 0)
+		{
+			mPaletteBase[i] = GetColorPalette()[i];
+		}
+	}
 }
 
 std::string TextEditor::GetText(const Coordinates & aStart, const Coordinates & aEnd) const
 {
 	std::string result;
+	if (aStart.mLine >= (int)mLines.size() || aEnd.mLine < aStart.mLine)
+	{
+		return result;
+	}
 
-	auto lstart = aStart.mLine;
-	auto lend = aEnd.mLine;
-	auto istart = GetCharacterIndex(aStart);
-	auto iend = GetCharacterIndex(aEnd);
-	size_t s = 0;
+	// Each line up to aEnd is followed by a line break, also the last one if aEnd is past it
+	const int lend = std::min(aEnd.mLine, (int)mLines.size());
+	const int istart = GetCharacterIndex(aStart);
+	const int iend = GetCharacterIndex(aEnd);
+	auto lineRange = [&](int aLine, int& aFrom, int& aTo)
+	{
+		auto size = (int)mLines[aLine].size();
+		aFrom = aLine == aStart.mLine ? std::min(istart, size) : 0;
+		aTo = aLine < aEnd.mLine ? size : std::min(iend, size);
+	};
 
-	for (size_t i = lstart; i < lend; i++)
+	size_t s = 0;
+	for (int i = aStart.mLine; i <= lend && i < (int)mLines.size(); ++i)
 	{
-		s += mLines[i].size();
+		int from, to;
+		lineRange(i, from, to);
+		s += std::max(0, to - from) + (i < aEnd.mLine ? 1 : 0);
 	}
 
-	result.reserve(s + s / 8);
-
-	while (istart < iend || lstart < lend)
+	result.resize(s);
+	auto out = &result[0];
+	for (int i = aStart.mLine; i <= lend && i < (int)mLines.size(); ++i)
 	{
-		if (lstart >= (int)mLines.size())
+		int from, to;
+		lineRange(i, from, to);
+		auto& line = mLines[i];
+		for (int j = from; j < to; ++j)
 		{
-			break;
+			*out++ = line[j].mChar;
 		}
 
-		auto& line = mLines[lstart];
-		if (istart < (int)line.size())
-		{
-			result += line[istart].mChar;
-			istart++;
-		}
-		else
+		if (i < aEnd.mLine)
 		{
-			istart = 0;
-			++lstart;
-			result += '\n';
+			*out++ = '\n';
 		}
 	}
 
@@ -180,6 +274,24 @@ static int UTF8CharLength(TextEditor::Char c)
 	return 1;
 }
 
+// Decodes the code point of a UTF-8 sequence of aLength glyphs, as measured by UTF8CharLength
+static unsigned int UTF8ToCodepoint(const TextEditor::Glyph* aSequence, int aLength)
+{
+	const unsigned char lead = (unsigned char)aSequence[0].mChar;
+	if (aLength <= 1)
+	{
+		return lead;
+	}
+
+	unsigned int codepoint = lead & (0xff >> (aLength + 1));
+	for (int i = 1; i < aLength; ++i)
+	{
+		codepoint = (codepoint << 6) | ((unsigned char)aSequence[i].mChar & 0x3f);
+	}
+
+	return codepoint;
+}
+
 static inline int ImTextCharToUtf8(char* buf, int buf_size, unsigned int c)
 {
 	if (c < 0x80)
@@ -269,6 +381,9 @@ void TextEditor::DeleteRange(const Coordinates & aStart, const Coordinates & aEn
 		{
 			line.erase(line.begin() + start, line.begin() + end);
 		}
+
+		line.Touch();
+		mLineWidths.MarkDirty(aStart.mLine);
 	}
 	else
 	{
@@ -281,8 +396,17 @@ void TextEditor::DeleteRange(const Coordinates & aStart, const Coordinates & aEn
 		if (aStart.mLine < aEnd.mLine)
 		{
 			firstLine.insert(firstLine.end(), lastLine.begin(), lastLine.end());
+
+			// Deleted from the start of the line, only the text of the last line is left, so its markers are kept
+			if (start == 0)
+			{
+				std::swap(firstLine.mMarkerSlot, lastLine.mMarkerSlot);
+			}
 		}
 
+		firstLine.Touch();
+		mLineWidths.MarkDirty(aStart.mLine);
+
 		if (aStart.mLine < aEnd.mLine)
 		{
 			RemoveLine(aStart.mLine + 1, aEnd.mLine + 1);
@@ -290,599 +414,2650 @@ void TextEditor::DeleteRange(const Coordinates & aStart, const Coordinates & aEn
 	}
 
 	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aStart.mLine, aStart.mLine + 1);
 }
 
 int TextEditor::InsertTextAt(Coordinates& /* inout */ aWhere, const char * aValue)
 {
 	assert(!mReadOnly);
+	assert(!mLines.empty());
 
-	int cindex = GetCharacterIndex(aWhere);
-	int totalLines = 0;
-	while (*aValue != '\0')
+	// The text is split into lines up front: the glyphs of each line are added at once, and the new lines are put
+	// into the document in one go, with the rest of the line at aWhere moved once to the end of the last one.
+	auto appendGlyphs = [](Line& aLine, const char* aBegin, const char* aEnd)
 	{
-		assert(!mLines.empty());
-
-		if (*aValue == '\r')
-		{
-			++aValue;
-		}
-		else if (*aValue == '\n')
+		const size_t size = aLine.size();
+		aLine.resize(size + (aEnd - aBegin), Glyph(' ', PaletteIndex::Default));
+		auto out = aLine.data() + size;
+		for (auto p = aBegin; p != aEnd; ++p)
 		{
-			if (cindex < (int)mLines[aWhere.mLine].size())
+			if (*p != '\r')
 			{
-				auto& newLine = InsertLine(aWhere.mLine + 1);
-				auto& line = mLines[aWhere.mLine];
-				newLine.insert(newLine.begin(), line.begin() + cindex, line.end());
-				line.erase(line.begin() + cindex, line.end());
+				(out++)->mChar = *p;
 			}
-			else
-			{
-				InsertLine(aWhere.mLine + 1);
-			}
-
-			++aWhere.mLine;
-			aWhere.mColumn = 0;
-			cindex = 0;
-			++totalLines;
-			++aValue;
 		}
-		else
-		{
-			auto& line = mLines[aWhere.mLine];
-			auto d = UTF8CharLength(*aValue);
-			while (d-- > 0 && *aValue != '\0')
-			{
-				line.insert(line.begin() + cindex++, Glyph(*aValue++, PaletteIndex::Default));
-			}
 
-			aWhere.mColumn = GetCharacterColumn(aWhere.mLine, cindex);
+		aLine.resize(out - aLine.data(), Glyph(' ', PaletteIndex::Default));
+	};
+
+	const int cindex = GetCharacterIndex(aWhere);
+	const char* end = aValue + strlen(aValue);
+	const char* firstEnd = std::find(aValue, end, '\n');
+
+	Line first;
+	appendGlyphs(first, aValue, firstEnd);
+
+	auto& line = mLines[aWhere.mLine];
+	if (firstEnd == end)
+	{
+		if (!first.empty())
+		{
+			line.insert(line.begin() + cindex, first.begin(), first.end());
+			line.Touch();
+			mLineWidths.MarkDirty(aWhere.mLine);
+			mTextChanged = true;
+			++mTextRevision;
+			InvalidateFindMatches(aWhere.mLine, aWhere.mLine + 1);
+			aWhere.mColumn = GetCharacterColumn(aWhere.mLine, cindex + (int)first.size());
 		}
 
-		mTextChanged = true;
+		return 0;
 	}
 
-	return totalLines;
-}
+	Lines added;
+	added.reserve(std::count(firstEnd, end, '\n'));
+	for (auto p = firstEnd; p != end; )
+	{
+		auto next = std::find(p + 1, end, '\n');
+		added.emplace_back();
+		appendGlyphs(added.back(), p + 1, next);
+		p = next;
+	}
 
-void TextEditor::AddUndo(UndoRecord& aValue)
-{
-	assert(!mReadOnly);
+	auto& last = added.back();
+	const int lastIndex = (int)last.size();
+	last.insert(last.end(), line.begin() + cindex, line.end());
+	line.erase(line.begin() + cindex, line.end());
+	line.insert(line.end(), first.begin(), first.end());
+	line.Touch();
+	mLineWidths.MarkDirty(aWhere.mLine);
+
+	// Inserted at the start of the line, the text of the line ends up on the last line, and its markers with it
+	const int shifted = cindex == 0 ? aWhere.mLine : aWhere.mLine + 1;
+	if (cindex == 0)
+	{
+		std::swap(line.mMarkerSlot, last.mMarkerSlot);
+	}
 
-	mUndoBuffer.resize((size_t)(mUndoIndex + 1));
-	mUndoBuffer.back() = aValue;
-	++mUndoIndex;
-}
+	const int count = (int)added.size();
+	mLines.insert(mLines.begin() + aWhere.mLine + 1, std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()));
+	mLineWidths.InsertLines(aWhere.mLine + 1, count);
+	mDiagnostics.InsertLines(shifted, count);
+	AttachMarkers();
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aWhere.mLine, aWhere.mLine + count + 1);
 
-TextEditor::Coordinates TextEditor::ScreenPosToCoordinates(const ImVec2& aPosition) const
-{
-	ImVec2 origin = ImGui::GetCursorScreenPos();
-	ImVec2 local(aPosition.x - origin.x, aPosition.y - origin.y);
+	aWhere.mLine += count;
+	aWhere.mColumn = GetCharacterColumn(aWhere.mLine, lastIndex);
+	return count;
+}
 
-	int lineNo = std::max(0, (int)floor(local.y / mCharAdvance.y));
+// Replaying an undo record costs about as much as restoring this many bytes of text, besides the text of the record,
+// and a line of the text about this many; see JumpToUndoNode()
+static const size_t sUndoRecordCost = 256;
+static const size_t sUndoLineCost = 64;
+static const size_t sUndoCheckpointMinCost = 64 * 1024;
 
-	int columnCoord = 0;
+void TextEditor::AddUndo(UndoRecord& aValue)
+{
+	assert(!mReadOnly);
 
-	if (lineNo >= 0 && lineNo < (int)mLines.size())
+	// Edits made at every cursor are collected into one record, see EditCursors()
+	if (mUndoBatch != nullptr)
 	{
-		auto& line = mLines.at(lineNo);
-
-		int columnIndex = 0;
-		float columnX = 0.0f;
+		mUndoBatch->mEdits.push_back(std::move(static_cast<UndoEdit&>(aValue)));
+		return;
+	}
 
-		while ((size_t)columnIndex < line.size())
+	// Only the newest node can be merged into, since it has no children yet
+	const double time = ImGui::GetTime();
+	const int newest = mUndoBase + (int)mUndoBuffer.size() - 1;
+	if (aValue.mKind != UndoKind::Other && mUndoNode != -1 && mUndoNode == newest && time <= mUndoMergeDeadline &&
+		MergeUndo(GetUndoRecord(mUndoNode), aValue))
+	{
+		// The text after the record changed, so its checkpoint is dropped; the next record takes one instead
+		auto& record = GetUndoRecord(mUndoNode);
+		record.mTime = time;
+		if (!record.mCheckpoint.IsEmpty())
 		{
-			float columnWidth = 0.0f;
+			mUndoArena.Release(record.mCheckpoint);
+			record.mCheckpoint = UndoArena::Text();
+		}
 
-			if (line[columnIndex].mChar == '\t')
-			{
-				float spaceSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, " ").x;
-				float oldX = columnX;
-				float newColumnX = (1.0f + std::floor((1.0f + columnX) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-				columnWidth = newColumnX - oldX;
-				if (mTextStart + columnX + columnWidth * 0.5f > local.x)
-				{
-					break;
-				}
+		const bool fromCheckpoint = record.mParent == -1 || !GetUndoRecord(record.mParent).mCheckpoint.IsEmpty();
+		record.mReplayCost = (fromCheckpoint ? 0 : GetUndoRecord(record.mParent).mReplayCost) + record.GetReplayCost();
+		mUndoMergeDeadline = time + mUndoMergeInterval;
+		TrimUndo();
+		return;
+	}
 
-				columnX = newColumnX;
-				columnCoord = (columnCoord / mTabSize) * mTabSize + mTabSize;
-				columnIndex++;
-			}
-			else
-			{
-				char buf[7];
-				auto d = UTF8CharLength(line[columnIndex].mChar);
-				int i = 0;
-				
-				while (i < 6 && d-- > 0)
-				{
-					buf[i++] = line[columnIndex++].mChar;
-				}
-				
-				buf[i] = '\0';
-				columnWidth = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf).x;
-				
-				if (mTextStart + columnX + columnWidth * 0.5f > local.x)
-				{
-					break;
-				}
+	auto store = [this](UndoEdit& aEdit)
+	{
+		aEdit.mAddedText = mUndoArena.Append(aEdit.mAdded);
+		aEdit.mRemovedText = mUndoArena.Append(aEdit.mRemoved);
+		std::string().swap(aEdit.mAdded);
+		std::string().swap(aEdit.mRemoved);
+	};
+
+	store(aValue);
+	for (auto& edit : aValue.mEdits)
+	{
+		store(edit);
+	}
 
-				columnX += columnWidth;
-				columnCoord++;
-			}
-		}
+	// Undone edits stay in the tree as another branch of the current node
+	aValue.mParent = mUndoNode;
+	aValue.mRedoChild = -1;
+	aValue.mTime = time;
+	aValue.mDropped = false;
+
+	// Once replaying the records since the last checkpoint costs about as much as restoring the text, the text
+	// after this record is kept as the next one
+	const bool fromCheckpoint = mUndoNode == -1 || !GetUndoRecord(mUndoNode).mCheckpoint.IsEmpty();
+	aValue.mReplayCost = (fromCheckpoint ? 0 : GetUndoRecord(mUndoNode).mReplayCost) + aValue.GetReplayCost();
+	aValue.mCheckpoint = UndoArena::Text();
+	if (aValue.mReplayCost >= std::max(sUndoCheckpointMinCost, mLines.size() * sUndoLineCost))
+	{
+		const int last = (int)mLines.size() - 1;
+		aValue.mCheckpoint = mUndoArena.Append(GetText(Coordinates(), Coordinates(last, GetLineMaxColumn(last))));
+		aValue.mReplayCost = 0;
 	}
 
-	return SanitizeCoordinates(Coordinates(lineNo, columnCoord));
+	GetUndoRedoChild(mUndoNode) = newest + 1;
+	mUndoNode = newest + 1;
+
+	mUndoBuffer.push_back(std::move(aValue));
+	mUndoMemory += mUndoBuffer.back().GetMemory();
+	mUndoMergeDeadline = mUndoBuffer.back().mKind != UndoKind::Other ? time + mUndoMergeInterval : -DBL_MAX;
+	TrimUndo();
 }
 
-TextEditor::Coordinates TextEditor::FindWordStart(const Coordinates & aFrom) const
+bool TextEditor::MergeUndo(UndoRecord& aInto, const UndoRecord& aNext)
 {
-	Coordinates at = aFrom;
-	if (at.mLine >= (int)mLines.size())
+	// Anything else that happened in between, e.g. moving the cursor, starts a new record
+	if (aInto.mKind != aNext.mKind || !aInto.mExtraAfter.empty() || !aNext.mExtraBefore.empty() ||
+		aInto.mAfter.mCursorPosition != aNext.mBefore.mCursorPosition ||
+		aInto.mAfter.mSelectionStart != aNext.mBefore.mSelectionStart ||
+		aInto.mAfter.mSelectionEnd != aNext.mBefore.mSelectionEnd)
 	{
-		return at;
+		return false;
 	}
 
-	auto& line = mLines[at.mLine];
-	auto cindex = GetCharacterIndex(at);
+	auto isSpace = [](char aChar) { return isascii(aChar) && isspace(aChar); };
+	auto& added = aInto.mAddedText;
+	auto& removed = aInto.mRemovedText;
 
-	if (cindex >= (int)line.size())
+	switch (aNext.mKind)
 	{
-		return at;
-	}
+	case UndoKind::Typing:
+		// A new word (or line) starts a new record
+		if (!aNext.mRemoved.empty() || added.IsEmpty() || aNext.mAdded.empty() || aNext.mAdded.front() == '\n' || aNext.mAddedStart != aInto.mAddedEnd ||
+			(isSpace(mUndoArena.GetChar(added, added.mLength - 1)) && !isSpace(aNext.mAdded.front())))
+		{
+			return false;
+		}
 
-	while (cindex > 0 && isspace(line[cindex].mChar))
-	{
-		--cindex;
-	}
+		added = mUndoArena.Append(added, aNext.mAdded);
+		aInto.mAddedEnd = aNext.mAddedEnd;
+		break;
 
-	auto cstart = (PaletteIndex)line[cindex].mColorIndex;
-	while (cindex > 0)
-	{
-		auto c = line[cindex].mChar;
-		if ((c & 0xC0) != 0x80)	// not UTF code sequence 10xxxxxx
+	case UndoKind::Backspace:
+		// The removed text grows to the left
+		if (!aNext.mAdded.empty() || !added.IsEmpty() || aNext.mRemoved.empty() || aNext.mRemoved == "\n" || aNext.mRemovedEnd != aInto.mRemovedStart ||
+			(isSpace(aNext.mRemoved.back()) && !isSpace(mUndoArena.GetChar(removed, 0))))
 		{
-			if (c <= 32 && isspace(c))
-			{
-				cindex++;
-				break;
-			}
+			return false;
+		}
 
-			if (cstart != (PaletteIndex)line[size_t(cindex - 1)].mColorIndex)
-			{
-				break;
-			}
+		removed = mUndoArena.Prepend(aNext.mRemoved, removed);
+		aInto.mRemovedStart = aNext.mRemovedStart;
+		break;
+
+	case UndoKind::Delete:
+		// The removed text grows to the right of the same position
+		if (!aNext.mAdded.empty() || !added.IsEmpty() || aNext.mRemoved.empty() || aNext.mRemoved == "\n" || aNext.mRemovedStart != aInto.mRemovedStart ||
+			(isSpace(aNext.mRemoved.front()) && !isSpace(mUndoArena.GetChar(removed, removed.mLength - 1))))
+		{
+			return false;
 		}
 
-		--cindex;
+		removed = mUndoArena.Append(removed, aNext.mRemoved);
+		mUndoArena.Read(removed, mUndoMergeText);
+		aInto.mRemovedEnd = GetTextEnd(aInto.mRemovedStart, mUndoMergeText);
+		break;
+
+	default:
+		return false;
 	}
 
-	return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
+	aInto.mAfter = aNext.mAfter;
+	return true;
 }
 
-TextEditor::Coordinates TextEditor::FindWordEnd(const Coordinates & aFrom) const
+void TextEditor::ReleaseUndo(UndoRecord& aRecord)
 {
-	Coordinates at = aFrom;
-	if (at.mLine >= (int)mLines.size())
+	mUndoArena.Release(aRecord.mAddedText);
+	mUndoArena.Release(aRecord.mRemovedText);
+	mUndoArena.Release(aRecord.mCheckpoint);
+	for (auto& edit : aRecord.mEdits)
 	{
-		return at;
+		mUndoArena.Release(edit.mAddedText);
+		mUndoArena.Release(edit.mRemovedText);
 	}
 
-	auto& line = mLines[at.mLine];
-	auto cindex = GetCharacterIndex(at);
+	mUndoMemory -= aRecord.GetMemory();
+}
 
-	if (cindex >= (int)line.size())
+void TextEditor::ClearUndo()
+{
+	// An edit in progress starts over from the new text
+	if (mEditDepth > 0)
 	{
-		return at;
+		mEditRecord.mEdits.clear();
+		mEditRecord.mBefore = mState;
+		mEditRecord.mExtraBefore = mExtraCursors;
 	}
 
-	bool prevspace = (bool)isspace(line[cindex].mChar);
-	auto cstart = (PaletteIndex)line[cindex].mColorIndex;
-	while (cindex < (int)line.size())
+	mUndoBase += (int)mUndoBuffer.size();
+	mUndoBuffer.clear();
+	mUndoArena.Clear();
+	mUndoNode = -1;
+	mUndoRootRedoChild = -1;
+	mUndoMemory = 0;
+}
+
+void TextEditor::TrimUndo()
+{
+	// The oldest node left always starts from the text before it, so dropping it moves that text forward
+	while (GetUndoMemoryUsage() > mUndoMemoryLimit)
 	{
-		auto c = line[cindex].mChar;
-		auto d = UTF8CharLength(c);
-		if (cstart != (PaletteIndex)line[cindex].mColorIndex)
+		while (!mUndoBuffer.empty() && mUndoBuffer.front().mDropped)
+		{
+			mUndoBuffer.pop_front();
+			++mUndoBase;
+		}
+
+		// The current node is kept whatever its size, so that the latest edit can always be undone
+		const int oldest = mUndoBase;
+		if (mUndoBuffer.empty() || oldest == mUndoNode)
 		{
 			break;
 		}
 
-		if (prevspace != !!isspace(c))
+		bool onPath = false;
+		for (int node = mUndoNode; node != -1 && node >= oldest; node = GetUndoRecord(node).mParent)
 		{
-			if (isspace(c))
+			onPath |= node == oldest;
+		}
+
+		if (!onPath)
+		{
+			DropUndoBranch(oldest);
+			continue;
+		}
+
+		// Branches that start before the oldest node cannot be reached anymore once it is applied for good
+		const int end = mUndoBase + (int)mUndoBuffer.size();
+		for (int node = oldest + 1; node < end; ++node)
+		{
+			auto& record = GetUndoRecord(node);
+			if (!record.mDropped && record.mParent == -1)
 			{
-				while (cindex < (int)line.size() && isspace(line[cindex].mChar))
-				{
-					++cindex;
-				}
+				DropUndoBranch(node);
 			}
+		}
 
-			break;
+		auto& record = GetUndoRecord(oldest);
+		for (int node = oldest + 1; node < end; ++node)
+		{
+			auto& child = GetUndoRecord(node);
+			if (!child.mDropped && child.mParent == oldest)
+			{
+				child.mParent = -1;
+			}
 		}
 
-		cindex += d;
+		mUndoRootRedoChild = record.mRedoChild;
+		ReleaseUndo(record);
+		record.mDropped = true;
 	}
 
-	return Coordinates(aFrom.mLine, GetCharacterColumn(aFrom.mLine, cindex));
-}
-
-TextEditor::Coordinates TextEditor::FindNextWord(const Coordinates & aFrom) const
-{
-	Coordinates at = aFrom;
-	if (at.mLine >= (int)mLines.size())
+	while (!mUndoBuffer.empty() && mUndoBuffer.front().mDropped)
 	{
-		return at;
+		mUndoBuffer.pop_front();
+		++mUndoBase;
 	}
+}
 
-	// skip to the next non-word character
-	auto cindex = GetCharacterIndex(aFrom);
-	bool isword = false;
-	bool skip = false;
-	if (cindex < (int)mLines[at.mLine].size())
+void TextEditor::DropUndoBranch(int aNode)
+{
+	auto& redoChild = GetUndoRedoChild(GetUndoRecord(aNode).mParent);
+	if (redoChild == aNode)
 	{
-		auto& line = mLines[at.mLine];
-		isword = isalnum(line[cindex].mChar);
-		skip = isword;
+		redoChild = -1;
 	}
 
-	while (!isword || skip)
+	// Children come after their parents, so one pass finds the whole branch
+	const int end = mUndoBase + (int)mUndoBuffer.size();
+	for (int node = aNode; node < end; ++node)
 	{
-		if (at.mLine >= mLines.size())
+		auto& record = GetUndoRecord(node);
+		if (!record.mDropped && (node == aNode || (record.mParent >= aNode && GetUndoRecord(record.mParent).mDropped)))
 		{
-			auto l = std::max(0, (int) mLines.size() - 1);
-			return Coordinates(l, GetLineMaxColumn(l));
+			ReleaseUndo(record);
+			record.mDropped = true;
 		}
+	}
+}
 
-		auto& line = mLines[at.mLine];
-		if (cindex < (int)line.size())
-		{
-			isword = isalnum(line[cindex].mChar);
+bool TextEditor::IsUndoNode(int aNode) const
+{
+	return aNode >= mUndoBase && aNode < mUndoBase + (int)mUndoBuffer.size() && !GetUndoRecord(aNode).mDropped;
+}
 
-			if (isword && !skip)
-			{
-				return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
-			}
+int TextEditor::GetUndoNodeParent(int aNode) const
+{
+	return IsUndoNode(aNode) ? GetUndoRecord(aNode).mParent : -1;
+}
 
-			if (!isword)
-			{
-				skip = false;
-			}
+double TextEditor::GetUndoNodeTime(int aNode) const
+{
+	return IsUndoNode(aNode) ? GetUndoRecord(aNode).mTime : 0.0;
+}
 
-			cindex++;
-		}
-		else
+void TextEditor::GetUndoNodes(std::vector<int>& aNodes) const
+{
+	aNodes.clear();
+	for (int node = mUndoBase; node < mUndoBase + (int)mUndoBuffer.size(); ++node)
+	{
+		if (!GetUndoRecord(node).mDropped)
 		{
-			cindex = 0;
-			++at.mLine;
-			skip = false;
-			isword = false;
+			aNodes.push_back(node);
 		}
 	}
-
-	return at;
 }
 
-int TextEditor::GetCharacterIndex(const Coordinates& aCoordinates) const
+bool TextEditor::JumpToUndoNode(int aNode)
 {
-	if (aCoordinates.mLine >= mLines.size())
+	if (IsReadOnly() || mEditDepth > 0 || (aNode != -1 && !IsUndoNode(aNode)))
 	{
-		return -1;
+		return false;
 	}
 
-	auto& line = mLines[aCoordinates.mLine];
-	int c = 0;
-	int i = 0;
+	// Only the edits between the two nodes are replayed: undo up to the closest common ancestor, then redo
+	// down to the node. The path is ordered by decreasing id, since parents come before their children.
+	std::vector<int> path;
+	for (int node = aNode; node != -1; node = GetUndoRecord(node).mParent)
+	{
+		path.push_back(node);
+	}
 
-	for (; i < line.size() && c < aCoordinates.mColumn;)
+	auto onPath = [&](int aNode) { return aNode == -1 || std::binary_search(path.begin(), path.end(), aNode, std::greater<int>()); };
+	size_t cost = 0;
+	int ancestor = mUndoNode;
+	for (; !onPath(ancestor); ancestor = GetUndoRecord(ancestor).mParent)
 	{
-		if (line[i].mChar == '\t')
-		{
-			c = (c / mTabSize) * mTabSize + mTabSize;
-		}
-		else
-		{
-			++c;
-		}
-
-		i += UTF8CharLength(line[i].mChar);
+		cost += GetUndoRecord(ancestor).GetReplayCost();
 	}
 
-	return i;
-}
-
-int TextEditor::GetCharacterColumn(int aLine, int aIndex) const
-{
-	if (aLine >= mLines.size())
+	const size_t ancestorIndex = ancestor == -1 ? path.size() : std::lower_bound(path.begin(), path.end(), ancestor, std::greater<int>()) - path.begin();
+	for (size_t i = 0; i < ancestorIndex; ++i)
 	{
-		return 0;
+		cost += GetUndoRecord(path[i]).GetReplayCost();
 	}
 
-	auto& line = mLines[aLine];
-	int col = 0;
-	int i = 0;
-	while (i < aIndex && i < (int)line.size())
+	// Unless restoring the closest checkpoint above the node and redoing from there is cheaper
+	size_t checkpoint = 0;
+	size_t checkpointCost = 0;
+	for (; checkpoint < path.size() && GetUndoRecord(path[checkpoint]).mCheckpoint.IsEmpty(); ++checkpoint)
 	{
-		auto c = line[i].mChar;
-		i += UTF8CharLength(c);
+		checkpointCost += GetUndoRecord(path[checkpoint]).GetReplayCost();
+	}
 
-		if (c == '\t')
+	size_t redoFrom = ancestorIndex;
+	mUndoMergeDeadline = -DBL_MAX;
+	mUndoJumping = true;
+	mUndoJumpColorFirst = mUndoJumpColorTail = std::numeric_limits<int>::max();
+	if (checkpoint < path.size() && checkpointCost + GetUndoRecord(path[checkpoint]).mCheckpoint.mLength < cost)
+	{
+		// The redo children are set as if the records had been replayed
+		for (int node = mUndoNode; node != ancestor; node = GetUndoRecord(node).mParent)
 		{
-			col = (col / mTabSize) * mTabSize + mTabSize;
+			GetUndoRedoChild(GetUndoRecord(node).mParent) = node;
 		}
-		else
+
+		for (size_t i = checkpoint + 1; i <= ancestorIndex; ++i)
 		{
-			col++;
+			GetUndoRedoChild(i < path.size() ? path[i] : -1) = path[i - 1];
 		}
-	}
-
-	return col;
-}
 
-int TextEditor::GetLineCharacterCount(int aLine) const
-{
-	if (aLine >= mLines.size())
-	{
-		return 0;
+		auto& record = GetUndoRecord(path[checkpoint]);
+		std::string text;
+		mUndoArena.Read(record.mCheckpoint, text);
+		ReplaceText(text);
+		mUndoNode = ancestor = path[checkpoint];
+		redoFrom = checkpoint;
+		mState = record.mAfter;
+		mExtraCursors = record.mExtraAfter;
 	}
 
-	auto& line = mLines[aLine];
-	int c = 0;
-
-	for (unsigned i = 0; i < line.size(); c++)
+	while (mUndoNode != ancestor)
 	{
-		i += UTF8CharLength(line[i].mChar);
+		auto& record = GetUndoRecord(mUndoNode);
+		record.Undo(this);
+		GetUndoRedoChild(record.mParent) = mUndoNode;
+		mUndoNode = record.mParent;
 	}
 
-	return c;
-}
-
-int TextEditor::GetLineMaxColumn(int aLine) const
-{
-	if (aLine >= mLines.size())
+	for (size_t i = redoFrom; i-- > 0; )
 	{
-		return 0;
+		GetUndoRedoChild(mUndoNode) = path[i];
+		mUndoNode = path[i];
+		GetUndoRecord(mUndoNode).Redo(this);
 	}
 
-	auto& line = mLines[aLine];
-	int col = 0;
-	for (unsigned i = 0; i < line.size(); )
+	// The lines changed on the way are colorized once
+	mUndoJumping = false;
+	if (mUndoJumpColorFirst != std::numeric_limits<int>::max())
 	{
-		auto c = line[i].mChar;
-		if (c == '\t')
-		{
-			col = (col / mTabSize) * mTabSize + mTabSize;
-		}
-		else
-		{
-			col++;
-		}
-
-		i += UTF8CharLength(c);
+		Colorize(mUndoJumpColorFirst, std::max(0, (int)mLines.size() - mUndoJumpColorTail - mUndoJumpColorFirst));
 	}
 
-	return col;
+	EnsureCursorVisible();
+	return true;
 }
 
-bool TextEditor::IsOnWordBoundary(const Coordinates & aAt) const
+void TextEditor::BeginEdit()
 {
-	if (aAt.mLine >= (int)mLines.size() || aAt.mColumn == 0)
+	if (mEditDepth++ > 0)
 	{
-		return true;
+		return;
 	}
 
-	auto& line = mLines[aAt.mLine];
-	auto cindex = GetCharacterIndex(aAt);
-	if (cindex >= (int)line.size())
+	mEditRecord = UndoRecord();
+	mEditRecord.mBefore = mState;
+	mEditRecord.mExtraBefore = mExtraCursors;
+	mUndoBatch = &mEditRecord;
+}
+
+void TextEditor::EndEdit()
+{
+	assert(mEditDepth > 0);
+	if (--mEditDepth > 0)
 	{
-		return true;
+		return;
 	}
 
-	if (mColorizerEnabled)
+	mUndoBatch = nullptr;
+	if (!mEditRecord.mEdits.empty())
 	{
-		return line[cindex].mColorIndex != line[size_t(cindex - 1)].mColorIndex;
+		mEditRecord.mAfter = mState;
+		mEditRecord.mExtraAfter = mExtraCursors;
+		AddUndo(mEditRecord);
 	}
 
-	return isspace(line[cindex].mChar) != isspace(line[cindex - 1].mChar);
+	mEditRecord = UndoRecord();
+	EnsureCursorVisible();
 }
 
-void TextEditor::RemoveLine(int aStart, int aEnd)
+void TextEditor::SetUndoMemoryLimit(size_t aBytes)
 {
-	assert(!mReadOnly);
-	assert(aEnd >= aStart);
-	assert(mLines.size() > (size_t)(aEnd - aStart));
+	mUndoMemoryLimit = aBytes;
+	TrimUndo();
+}
 
-	ErrorMarkers etmp;
-	for (auto& i : mErrorMarkers)
+TextEditor::Coordinates TextEditor::GetTextEnd(const Coordinates& aStart, const std::string& aText) const
+{
+	// The text is assumed to be at aStart, the columns before it stay the same
+	auto end = aStart;
+	for (size_t i = 0; i < aText.size(); )
 	{
-		ErrorMarkers::value_type e(i.first >= aStart ? i.first - 1 : i.first, i.second);
-		if (e.first >= aStart && e.first <= aEnd)
+		auto c = (Char)aText[i];
+		i += UTF8CharLength(c);
+
+		if (c == '\n')
 		{
-			continue;
+			++end.mLine;
+			end.mColumn = 0;
+		}
+		else if (c == '\t')
+		{
+			end.mColumn = (end.mColumn / mTabSize) * mTabSize + mTabSize;
+		}
+		else
+		{
+			++end.mColumn;
 		}
-
-		etmp.insert(e);
 	}
 
-	mErrorMarkers = std::move(etmp);
+	return end;
+}
 
-	Breakpoints btmp;
-	for (auto i : mBreakpoints)
-	{
-		if (i >= aStart && i <= aEnd)
-		{
-			continue;
-		}
+TextEditor::Coordinates TextEditor::ScreenPosToCoordinates(const ImVec2& aPosition) const
+{
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	ImVec2 local(aPosition.x - origin.x, aPosition.y - mContentTopY);
 
-		btmp.insert(i >= aStart ? i - 1 : i);
-	}
+	int lineNo = (int)std::max(0.0, floor((local.y + mScrollY) / mCharAdvance.y));
 
-	mBreakpoints = std::move(btmp);
+	int columnCoord = 0;
 
-	mLines.erase(mLines.begin() + aStart, mLines.begin() + aEnd);
-	assert(!mLines.empty());
+	if (lineNo >= 0 && lineNo < (int)mLines.size())
+	{
+		columnCoord = mFixedPitch ? ScreenPosToColumn<true>(lineNo, local.x) : ScreenPosToColumn<false>(lineNo, local.x);
+	}
 
-	mTextChanged = true;
+	return SanitizeCoordinates(Coordinates(lineNo, columnCoord));
 }
 
-void TextEditor::RemoveLine(int aIndex)
+template <bool FixedPitch>
+int TextEditor::ScreenPosToColumn(int aLine, float aX) const
 {
-	assert(!mReadOnly);
-	assert(mLines.size() > 1);
+	auto& layout = GetLineLayout(aLine);
+	const float x = aX - mTextStart;
 
-	ErrorMarkers etmp;
-	for (auto& i : mErrorMarkers)
+	// Binary search for the first glyph whose middle is right of x
+	int first = 0;
+	int last = (int)layout.mOffsets.size() - 1;
+	while (first < last)
 	{
-		ErrorMarkers::value_type e(i.first > aIndex ? i.first - 1 : i.first, i.second);
-		if (e.first - 1 == aIndex)
+		const int middle = (first + last) / 2;
+		if ((layout.mOffsets[middle] + layout.mOffsets[middle + 1]) * 0.5f > x)
 		{
-			continue;
+			last = middle;
 		}
-
-		etmp.insert(e);
-	}
-
-	mErrorMarkers = std::move(etmp);
-
-	Breakpoints btmp;
-	for (auto i : mBreakpoints)
-	{
-		if (i == aIndex)
+		else
 		{
-			continue;
+			first = middle + 1;
 		}
-
-		btmp.insert(i >= aIndex ? i - 1 : i);
 	}
 
-	mBreakpoints = std::move(btmp);
-
-	mLines.erase(mLines.begin() + aIndex);
-	assert(!mLines.empty());
-
-	mTextChanged = true;
+	return layout.mColumns[first];
 }
 
-TextEditor::Line& TextEditor::InsertLine(int aIndex)
+// Every glyph covers exactly one cell, so the column under aX is found without measuring anything.
+// Only a tab, which spans several cells, needs the glyph boundaries to snap to its nearer edge.
+// Non-ASCII characters may be wider than a cell (e.g. CJK), so their lines are searched by x offset.
+template <>
+int TextEditor::ScreenPosToColumn<true>(int aLine, float aX) const
 {
-	assert(!mReadOnly);
-
-	auto& result = *mLines.insert(mLines.begin() + aIndex, Line());
-
-	ErrorMarkers etmp;
-	for (auto& i : mErrorMarkers)
+	auto& layout = GetLineLayout(aLine);
+	if (!layout.mCells)
 	{
-		etmp.insert(ErrorMarkers::value_type(i.first >= aIndex ? i.first + 1 : i.first, i.second));
+		return ScreenPosToColumn<false>(aLine, aX);
 	}
 
-	mErrorMarkers = std::move(etmp);
+	auto& columns = layout.mColumns;
 
-	Breakpoints btmp;
-	for (auto i : mBreakpoints)
+	const float x = (aX - mTextStart) / mCharAdvance.x;
+	const int column = std::max(0, (int)std::floor(x + 0.5f));
+
+	auto it = std::lower_bound(columns.begin(), columns.end() - 1, column);
+	if (it != columns.begin() && *it > column)
 	{
-		btmp.insert(i >= aIndex ? i + 1 : i);
+		const int tabStart = *(it - 1);
+		return x < (tabStart + *it) * 0.5f ? tabStart : *it;
 	}
 
-	mBreakpoints = std::move(btmp);
-
-	return result;
-}
-
-std::string TextEditor::GetWordUnderCursor() const
-{
-	auto c = GetCursorPosition();
-	return GetWordAt(c);
+	return *it;
 }
 
-std::string TextEditor::GetWordAt(const Coordinates & aCoords) const
+TextEditor::Coordinates TextEditor::FindWordStart(const Coordinates & aFrom) const
 {
-	auto start = FindWordStart(aCoords);
-	auto end = FindWordEnd(aCoords);
-
-	std::string r;
-
-	auto istart = GetCharacterIndex(start);
-	auto iend = GetCharacterIndex(end);
-
-	for (auto it = istart; it < iend; ++it)
+	Coordinates at = aFrom;
+	if (at.mLine >= (int)mLines.size())
 	{
-		r.push_back(mLines[aCoords.mLine][it].mChar);
+		return at;
 	}
 
-	return r;
-}
+	auto& line = mLines[at.mLine];
+	auto cindex = GetCharacterIndex(at);
 
-ImU32 TextEditor::GetGlyphColor(const Glyph & aGlyph) const
-{
-	if (!mColorizerEnabled)
+	if (cindex >= (int)line.size())
 	{
-		return mPalette[(int)PaletteIndex::Default];
+		return at;
 	}
 
-	if (aGlyph.mComment)
+	while (cindex > 0 && isspace(line[cindex].mChar))
 	{
-		return mPalette[(int)PaletteIndex::Comment];
+		--cindex;
 	}
 
-	if (aGlyph.mMultiLineComment)
+	auto cstart = (PaletteIndex)line[cindex].mColorIndex;
+	while (cindex > 0)
 	{
-		return mPalette[(int)PaletteIndex::MultiLineComment];
-	}
+		auto c = line[cindex].mChar;
+		if ((c & 0xC0) != 0x80)	// not UTF code sequence 10xxxxxx
+		{
+			if (c <= 32 && isspace(c))
+			{
+				cindex++;
+				break;
+			}
 
-	auto const color = mPalette[(int)aGlyph.mColorIndex];
-	if (aGlyph.mPreprocessor)
-	{
-		const auto ppcolor = mPalette[(int)PaletteIndex::Preprocessor];
-		const int c0 = ((ppcolor & 0xff) + (color & 0xff)) / 2;
-		const int c1 = (((ppcolor >> 8) & 0xff) + ((color >> 8) & 0xff)) / 2;
-		const int c2 = (((ppcolor >> 16) & 0xff) + ((color >> 16) & 0xff)) / 2;
-		const int c3 = (((ppcolor >> 24) & 0xff) + ((color >> 24) & 0xff)) / 2;
-		return ImU32(c0 | (c1 << 8) | (c2 << 16) | (c3 << 24));
+			if (cstart != (PaletteIndex)line[size_t(cindex - 1)].mColorIndex)
+			{
+				break;
+			}
+		}
+
+		--cindex;
 	}
 
-	return color;
+	return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
 }
 
-void TextEditor::HandleKeyboardInputs()
+TextEditor::Coordinates TextEditor::FindWordEnd(const Coordinates & aFrom) const
 {
-	if (ImGui::IsWindowFocused())
+	Coordinates at = aFrom;
+	if (at.mLine >= (int)mLines.size())
 	{
-		if (ImGui::IsWindowHovered())
-			ImGui::SetMouseCursor(ImGuiMouseCursor_TextInput);
-		//ImGui::CaptureKeyboardFromApp(true);
-
-		ImGuiIO& io = ImGui::GetIO();
-		auto isOSX = io.ConfigMacOSXBehaviors;
-		auto alt = io.KeyAlt;
-		auto ctrl = io.KeyCtrl;
-		auto shift = io.KeyShift;
-		auto super = io.KeySuper;
+		return at;
+	}
 
-		auto isShortcut = (isOSX ? (super && !ctrl) : (ctrl && !super)) && !alt && !shift;
-		auto isShiftShortcut = (isOSX ? (super && !ctrl) : (ctrl && !super)) && shift && !alt;
-		auto isWordmoveKey = isOSX ? alt : ctrl;
-		auto isAltOnly = alt && !ctrl && !shift && !super;
-		auto isCtrlOnly = ctrl && !alt && !shift && !super;
-		auto isShiftOnly = shift && !alt && !ctrl && !super;
+	auto& line = mLines[at.mLine];
+	auto cindex = GetCharacterIndex(at);
 
-		io.WantCaptureKeyboard = true;
-		io.WantTextInput = true;
+	if (cindex >= (int)line.size())
+	{
+		return at;
+	}
 
-		if (!IsReadOnly() && isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)))
+	bool prevspace = (bool)isspace(line[cindex].mChar);
+	auto cstart = (PaletteIndex)line[cindex].mColorIndex;
+	while (cindex < (int)line.size())
+	{
+		auto c = line[cindex].mChar;
+		auto d = UTF8CharLength(c);
+		if (cstart != (PaletteIndex)line[cindex].mColorIndex)
 		{
-			Undo();
+			break;
 		}
-		else if (!IsReadOnly() && isAltOnly && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Backspace)))
+
+		if (prevspace != !!isspace(c))
 		{
-			Undo();
+			if (isspace(c))
+			{
+				while (cindex < (int)line.size() && isspace(line[cindex].mChar))
+				{
+					++cindex;
+				}
+			}
+
+			break;
+		}
+
+		cindex += d;
+	}
+
+	return Coordinates(aFrom.mLine, GetCharacterColumn(aFrom.mLine, cindex));
+}
+
+TextEditor::Coordinates TextEditor::FindNextWord(const Coordinates & aFrom) const
+{
+	Coordinates at = aFrom;
+	if (at.mLine >= (int)mLines.size())
+	{
+		return at;
+	}
+
+	// skip to the next non-word character
+	auto cindex = GetCharacterIndex(aFrom);
+	bool isword = false;
+	bool skip = false;
+	if (cindex < (int)mLines[at.mLine].size())
+	{
+		auto& line = mLines[at.mLine];
+		isword = isalnum(line[cindex].mChar);
+		skip = isword;
+	}
+
+	while (!isword || skip)
+	{
+		if (at.mLine >= mLines.size())
+		{
+			auto l = std::max(0, (int) mLines.size() - 1);
+			return Coordinates(l, GetLineMaxColumn(l));
+		}
+
+		auto& line = mLines[at.mLine];
+		if (cindex < (int)line.size())
+		{
+			isword = isalnum(line[cindex].mChar);
+
+			if (isword && !skip)
+			{
+				return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
+			}
+
+			if (!isword)
+			{
+				skip = false;
+			}
+
+			cindex++;
+		}
+		else
+		{
+			cindex = 0;
+			++at.mLine;
+			skip = false;
+			isword = false;
+		}
+	}
+
+	return at;
+}
+
+int TextEditor::GetCharacterIndex(const Coordinates& aCoordinates) const
+{
+	if (aCoordinates.mLine >= mLines.size())
+	{
+		return -1;
+	}
+
+	auto& line = mLines[aCoordinates.mLine];
+	int c = 0;
+	int i = 0;
+
+	for (; i < line.size() && c < aCoordinates.mColumn;)
+	{
+		if (line[i].mChar == '\t')
+		{
+			c = (c / mTabSize) * mTabSize + mTabSize;
+		}
+		else
+		{
+			++c;
+		}
+
+		i += UTF8CharLength(line[i].mChar);
+	}
+
+	return i;
+}
+
+int TextEditor::GetCharacterColumn(int aLine, int aIndex) const
+{
+	if (aLine >= mLines.size())
+	{
+		return 0;
+	}
+
+	auto& line = mLines[aLine];
+	int col = 0;
+	int i = 0;
+	while (i < aIndex && i < (int)line.size())
+	{
+		auto c = line[i].mChar;
+		i += UTF8CharLength(c);
+
+		if (c == '\t')
+		{
+			col = (col / mTabSize) * mTabSize + mTabSize;
+		}
+		else
+		{
+			col++;
+		}
+	}
+
+	return col;
+}
+
+int TextEditor::GetLineCharacterCount(int aLine) const
+{
+	if (aLine >= mLines.size())
+	{
+		return 0;
+	}
+
+	auto& line = mLines[aLine];
+	int c = 0;
+
+	for (unsigned i = 0; i < line.size(); c++)
+	{
+		i += UTF8CharLength(line[i].mChar);
+	}
+
+	return c;
+}
+
+int TextEditor::GetLineMaxColumn(int aLine) const
+{
+	if (aLine >= mLines.size())
+	{
+		return 0;
+	}
+
+	auto& line = mLines[aLine];
+	int col = 0;
+	for (unsigned i = 0; i < line.size(); )
+	{
+		auto c = line[i].mChar;
+		if (c == '\t')
+		{
+			col = (col / mTabSize) * mTabSize + mTabSize;
+		}
+		else
+		{
+			col++;
+		}
+
+		i += UTF8CharLength(c);
+	}
+
+	return col;
+}
+
+bool TextEditor::IsOnWordBoundary(const Coordinates & aAt) const
+{
+	if (aAt.mLine >= (int)mLines.size() || aAt.mColumn == 0)
+	{
+		return true;
+	}
+
+	auto& line = mLines[aAt.mLine];
+	auto cindex = GetCharacterIndex(aAt);
+	if (cindex >= (int)line.size())
+	{
+		return true;
+	}
+
+	if (mColorizerEnabled)
+	{
+		return line[cindex].mColorIndex != line[size_t(cindex - 1)].mColorIndex;
+	}
+
+	return isspace(line[cindex].mChar) != isspace(line[cindex - 1].mChar);
+}
+
+void TextEditor::RemoveLine(int aStart, int aEnd)
+{
+	assert(!mReadOnly);
+	assert(aEnd >= aStart);
+	assert(mLines.size() > (size_t)(aEnd - aStart));
+
+	for (int i = aStart; i < aEnd; ++i)
+	{
+		ReleaseLineMarkers(mLines[i]);
+	}
+
+	mLines.erase(mLines.begin() + aStart, mLines.begin() + aEnd);
+	mLineWidths.RemoveLines(aStart, aEnd);
+	mDiagnostics.RemoveLines(aStart, aEnd);
+	assert(!mLines.empty());
+
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aStart, aStart);
+}
+
+void TextEditor::RemoveLine(int aIndex)
+{
+	assert(!mReadOnly);
+	assert(mLines.size() > 1);
+
+	ReleaseLineMarkers(mLines[aIndex]);
+
+	mLines.erase(mLines.begin() + aIndex);
+	mLineWidths.RemoveLines(aIndex, aIndex + 1);
+	mDiagnostics.RemoveLines(aIndex, aIndex + 1);
+	assert(!mLines.empty());
+
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aIndex, aIndex);
+}
+
+TextEditor::Line& TextEditor::InsertLine(int aIndex)
+{
+	assert(!mReadOnly);
+
+	auto& result = *mLines.insert(mLines.begin() + aIndex, Line());
+	mLineWidths.InsertLines(aIndex, 1);
+	mDiagnostics.InsertLines(aIndex, 1);
+	AttachMarkers();
+
+	return result;
+}
+
+void TextEditor::MoveLines(int aFirst, LineOrder& aOrder)
+{
+	ReorderLines(aFirst, aOrder);
+
+	UndoRecord u;
+	u.mMovedFirst = aFirst;
+	u.mMovedOrder.swap(aOrder);
+	AddUndo(u);
+}
+
+void TextEditor::ReorderLines(int aFirst, const LineOrder& aOrder)
+{
+	assert(!mReadOnly);
+	assert(aFirst >= 0 && aFirst + aOrder.size() <= mLines.size());
+
+	// Line aFirst + aOrder[i] becomes line aFirst + i; the lines are moved, so they keep their markers
+	const int count = (int)aOrder.size();
+	Lines moved;
+	moved.reserve(count);
+	for (auto offset : aOrder)
+	{
+		moved.push_back(std::move(mLines[aFirst + offset]));
+	}
+
+	std::move(moved.begin(), moved.end(), mLines.begin() + aFirst);
+	mDiagnostics.MoveLines(aFirst, aOrder);
+	for (int i = aFirst; i < aFirst + count; ++i)
+	{
+		mLineWidths.MarkDirty(i);
+	}
+
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aFirst, aFirst + count);
+	Colorize(aFirst - 1, count + 2);
+}
+
+void TextEditor::SetLineTexts(int aFirst, const std::string& aText)
+{
+	assert(!mReadOnly);
+
+	// The glyphs of the lines are replaced, while the lines themselves and their markers stay
+	int index = aFirst;
+	auto begin = aText.c_str();
+	const auto end = begin + aText.size();
+	for (;;)
+	{
+		auto next = std::find(begin, end, '\n');
+		assert(index < (int)mLines.size());
+		auto& line = mLines[index];
+		line.clear();
+		for (auto p = begin; p != next; ++p)
+		{
+			if (*p != '\r')
+			{
+				line.push_back(Glyph(*p, PaletteIndex::Default));
+			}
+		}
+
+		line.Touch();
+		mLineWidths.MarkDirty(index);
+		++index;
+		if (next == end)
+		{
+			break;
+		}
+
+		begin = next + 1;
+	}
+
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aFirst, index);
+	Colorize(aFirst - 1, index - aFirst + 2);
+}
+
+void TextEditor::SetErrorMarkers(const ErrorMarkers& aMarkers)
+{
+	for (int i = 0; i < (int)mLines.size(); ++i)
+	{
+		if (mLines[i].mMarkerSlot != 0)
+		{
+			auto& markers = mMarkerSlots[mLines[i].mMarkerSlot];
+			markers.mError = false;
+			markers.mErrorMessage.clear();
+			ReleaseEmptyLineMarkers(i);
+		}
+	}
+
+	for (auto it = mPendingMarkers.begin(); it != mPendingMarkers.end(); )
+	{
+		const int line = it->first;
+		auto& markers = mMarkerSlots[(it++)->second];
+		markers.mError = false;
+		markers.mErrorMessage.clear();
+		ReleaseEmptyLineMarkers(line);
+	}
+
+	for (auto& marker : aMarkers)
+	{
+		AddErrorMarker(marker.first, marker.second);
+	}
+
+	++mMarkersRevision;
+}
+
+void TextEditor::AddErrorMarker(int aLine, const std::string& aMessage)
+{
+	if (auto markers = EditLineMarkers(aLine - 1))
+	{
+		markers->mError = true;
+		markers->mErrorMessage = aMessage;
+	}
+}
+
+void TextEditor::RemoveErrorMarker(int aLine)
+{
+	if (GetLineMarkers(aLine - 1) != nullptr)
+	{
+		auto markers = EditLineMarkers(aLine - 1);
+		markers->mError = false;
+		markers->mErrorMessage.clear();
+		ReleaseEmptyLineMarkers(aLine - 1);
+	}
+}
+
+TextEditor::ErrorMarkers TextEditor::GetErrorMarkers() const
+{
+	ErrorMarkers result;
+	for (int i = 0; i < (int)mLines.size(); ++i)
+	{
+		auto markers = GetLineMarkers(i);
+		if (markers != nullptr && markers->mError)
+		{
+			result.insert(ErrorMarkers::value_type(i + 1, markers->mErrorMessage));
+		}
+	}
+
+	for (auto& pending : mPendingMarkers)
+	{
+		auto& markers = mMarkerSlots[pending.second];
+		if (markers.mError)
+		{
+			result.insert(ErrorMarkers::value_type(pending.first + 1, markers.mErrorMessage));
+		}
+	}
+
+	return result;
+}
+
+void TextEditor::SetBreakpoints(const Breakpoints& aMarkers)
+{
+	for (int i = 0; i < (int)mLines.size(); ++i)
+	{
+		if (mLines[i].mMarkerSlot != 0)
+		{
+			mMarkerSlots[mLines[i].mMarkerSlot].mBreakpoint = false;
+			ReleaseEmptyLineMarkers(i);
+		}
+	}
+
+	for (auto it = mPendingMarkers.begin(); it != mPendingMarkers.end(); )
+	{
+		const int line = it->first;
+		mMarkerSlots[(it++)->second].mBreakpoint = false;
+		ReleaseEmptyLineMarkers(line);
+	}
+
+	for (auto line : aMarkers)
+	{
+		AddBreakpoint(line);
+	}
+
+	++mMarkersRevision;
+}
+
+void TextEditor::AddBreakpoint(int aLine)
+{
+	if (auto markers = EditLineMarkers(aLine - 1))
+	{
+		markers->mBreakpoint = true;
+	}
+}
+
+void TextEditor::RemoveBreakpoint(int aLine)
+{
+	if (GetLineMarkers(aLine - 1) != nullptr)
+	{
+		EditLineMarkers(aLine - 1)->mBreakpoint = false;
+		ReleaseEmptyLineMarkers(aLine - 1);
+	}
+}
+
+bool TextEditor::HasBreakpoint(int aLine) const
+{
+	auto markers = GetLineMarkers(aLine - 1);
+	return markers != nullptr && markers->mBreakpoint;
+}
+
+TextEditor::Breakpoints TextEditor::GetBreakpoints() const
+{
+	Breakpoints result;
+	for (int i = 0; i < (int)mLines.size(); ++i)
+	{
+		auto markers = GetLineMarkers(i);
+		if (markers != nullptr && markers->mBreakpoint)
+		{
+			result.insert(i + 1);
+		}
+	}
+
+	for (auto& pending : mPendingMarkers)
+	{
+		if (mMarkerSlots[pending.second].mBreakpoint)
+		{
+			result.insert(pending.first + 1);
+		}
+	}
+
+	return result;
+}
+
+void TextEditor::AddBookmark(int aLine)
+{
+	if (auto markers = EditLineMarkers(aLine - 1))
+	{
+		markers->mBookmark = true;
+	}
+}
+
+void TextEditor::RemoveBookmark(int aLine)
+{
+	if (GetLineMarkers(aLine - 1) != nullptr)
+	{
+		EditLineMarkers(aLine - 1)->mBookmark = false;
+		ReleaseEmptyLineMarkers(aLine - 1);
+	}
+}
+
+bool TextEditor::HasBookmark(int aLine) const
+{
+	auto markers = GetLineMarkers(aLine - 1);
+	return markers != nullptr && markers->mBookmark;
+}
+
+std::vector<int> TextEditor::GetBookmarks() const
+{
+	std::vector<int> result;
+	for (int i = 0; i < (int)mLines.size(); ++i)
+	{
+		auto markers = GetLineMarkers(i);
+		if (markers != nullptr && markers->mBookmark)
+		{
+			result.push_back(i + 1);
+		}
+	}
+
+	for (auto& pending : mPendingMarkers)
+	{
+		if (mMarkerSlots[pending.second].mBookmark)
+		{
+			result.push_back(pending.first + 1);
+		}
+	}
+
+	return result;
+}
+
+const TextEditor::LineMarkers* TextEditor::GetLineMarkers(int aLine) const
+{
+	if (aLine >= (int)mLines.size())
+	{
+		auto it = mPendingMarkers.find(aLine);
+		return it != mPendingMarkers.end() ? &mMarkerSlots[it->second] : nullptr;
+	}
+
+	if (aLine < 0 || mLines[aLine].mMarkerSlot == 0)
+	{
+		return nullptr;
+	}
+
+	return &mMarkerSlots[mLines[aLine].mMarkerSlot];
+}
+
+TextEditor::LineMarkers* TextEditor::EditLineMarkers(int aLine)
+{
+	if (aLine < 0)
+	{
+		return nullptr;
+	}
+
+	auto& slot = aLine < (int)mLines.size() ? mLines[aLine].mMarkerSlot : mPendingMarkers[aLine];
+	if (slot == 0)
+	{
+		slot = AllocateMarkerSlot();
+	}
+
+	++mMarkersRevision;
+	return &mMarkerSlots[slot];
+}
+
+void TextEditor::ReleaseEmptyLineMarkers(int aLine)
+{
+	if (aLine >= (int)mLines.size())
+	{
+		auto it = mPendingMarkers.find(aLine);
+		if (it != mPendingMarkers.end() && mMarkerSlots[it->second].IsEmpty())
+		{
+			ReleaseMarkerSlot(it->second);
+			mPendingMarkers.erase(it);
+		}
+
+		return;
+	}
+
+	auto& line = mLines[aLine];
+	if (line.mMarkerSlot != 0 && mMarkerSlots[line.mMarkerSlot].IsEmpty())
+	{
+		ReleaseLineMarkers(line);
+	}
+}
+
+void TextEditor::ReleaseLineMarkers(Line& aLine)
+{
+	if (aLine.mMarkerSlot != 0)
+	{
+		ReleaseMarkerSlot(aLine.mMarkerSlot);
+		aLine.mMarkerSlot = 0;
+	}
+}
+
+uint32_t TextEditor::AllocateMarkerSlot()
+{
+	if (mFreeMarkerSlots.empty())
+	{
+		mMarkerSlots.emplace_back();
+		return (uint32_t)mMarkerSlots.size() - 1;
+	}
+
+	const auto slot = mFreeMarkerSlots.back();
+	mFreeMarkerSlots.pop_back();
+	return slot;
+}
+
+void TextEditor::ReleaseMarkerSlot(uint32_t aSlot)
+{
+	mMarkerSlots[aSlot] = LineMarkers();
+	mFreeMarkerSlots.push_back(aSlot);
+	++mMarkersRevision;
+}
+
+void TextEditor::LineMarkers::Merge(const LineMarkers& aOther)
+{
+	mBreakpoint |= aOther.mBreakpoint;
+	mBookmark |= aOther.mBookmark;
+	if (aOther.mError && !mError)
+	{
+		mError = true;
+		mErrorMessage = aOther.mErrorMessage;
+	}
+}
+
+void TextEditor::MergeLineMarkers(int aFrom, int aInto)
+{
+	// Used when two lines are joined: the joined line keeps the markers of both
+	auto from = GetLineMarkers(aFrom);
+	if (from == nullptr)
+	{
+		return;
+	}
+
+	const LineMarkers source = *from;
+	EditLineMarkers(aInto)->Merge(source);
+	ReleaseLineMarkers(mLines[aFrom]);
+}
+
+void TextEditor::DetachMarkers()
+{
+	// The markers stay on their line numbers when the whole text is replaced, see AttachMarkers()
+	for (size_t i = 0; i < mLines.size(); ++i)
+	{
+		if (mLines[i].mMarkerSlot != 0)
+		{
+			mPendingMarkers[(int)i] = mLines[i].mMarkerSlot;
+			mLines[i].mMarkerSlot = 0;
+		}
+	}
+
+	++mMarkersRevision;
+}
+
+void TextEditor::AttachMarkers()
+{
+	// Markers of lines past the end of the text go to those lines once the text has them
+	while (!mPendingMarkers.empty() && mPendingMarkers.begin()->first < (int)mLines.size())
+	{
+		const auto pending = *mPendingMarkers.begin();
+		mPendingMarkers.erase(mPendingMarkers.begin());
+		auto& line = mLines[pending.first];
+		if (line.mMarkerSlot == 0)
+		{
+			line.mMarkerSlot = pending.second;
+		}
+		else
+		{
+			mMarkerSlots[line.mMarkerSlot].Merge(mMarkerSlots[pending.second]);
+			ReleaseMarkerSlot(pending.second);
+		}
+
+		++mMarkersRevision;
+	}
+}
+
+std::string TextEditor::GetWordUnderCursor() const
+{
+	auto c = GetCursorPosition();
+	return GetWordAt(c);
+}
+
+std::string TextEditor::GetWordAt(const Coordinates & aCoords) const
+{
+	std::string r;
+	GetWordAt(aCoords, r);
+	return r;
+}
+
+void TextEditor::GetWordAt(const Coordinates & aCoords, std::string & aResult) const
+{
+	auto start = FindWordStart(aCoords);
+	auto end = FindWordEnd(aCoords);
+
+	aResult.clear();
+
+	auto istart = GetCharacterIndex(start);
+	auto iend = GetCharacterIndex(end);
+
+	for (auto it = istart; it < iend; ++it)
+	{
+		aResult.push_back(mLines[aCoords.mLine][it].mChar);
+	}
+}
+
+ImU32 TextEditor::GetGlyphColor(const Glyph & aGlyph) const
+{
+	if (!mColorizerEnabled)
+	{
+		return mPalette[(int)PaletteIndex::Default];
+	}
+
+	if (aGlyph.mComment)
+	{
+		return mPalette[(int)PaletteIndex::Comment];
+	}
+
+	if (aGlyph.mMultiLineComment)
+	{
+		return mPalette[(int)PaletteIndex::MultiLineComment];
+	}
+
+	auto const color = mPalette[(int)aGlyph.mColorIndex];
+	if (aGlyph.mPreprocessor)
+	{
+		const auto ppcolor = mPalette[(int)PaletteIndex::Preprocessor];
+		const int c0 = ((ppcolor & 0xff) + (color & 0xff)) / 2;
+		const int c1 = (((ppcolor >> 8) & 0xff) + ((color >> 8) & 0xff)) / 2;
+		const int c2 = (((ppcolor >> 16) & 0xff) + ((color >> 16) & 0xff)) / 2;
+		const int c3 = (((ppcolor >> 24) & 0xff) + ((color >> 24) & 0xff)) / 2;
+		return ImU32(c0 | (c1 << 8) | (c2 << 16) | (c3 << 24));
+	}
+
+	return color;
+}
+
+void TextEditor::AddCursor(const Coordinates& aPosition)
+{
+	EditorState state;
+	state.mCursorPosition = state.mSelectionStart = state.mSelectionEnd = SanitizeCoordinates(aPosition);
+	InsertExtraCursor(state);
+	MergeCursors();
+}
+
+void TextEditor::AddCursorAbove()
+{
+	// At the column of the primary cursor, on the line above the topmost one
+	Cursors cursors;
+	GetCursors(cursors);
+	const int line = std::min(cursors.front().mCursorPosition.mLine, cursors.front().mSelectionStart.mLine);
+	if (line > 0)
+	{
+		AddCursor(Coordinates(line - 1, mState.mCursorPosition.mColumn));
+	}
+}
+
+void TextEditor::AddCursorBelow()
+{
+	Cursors cursors;
+	GetCursors(cursors);
+	const int line = std::max(cursors.back().mCursorPosition.mLine, cursors.back().mSelectionEnd.mLine);
+	if (line + 1 < (int)mLines.size())
+	{
+		AddCursor(Coordinates(line + 1, mState.mCursorPosition.mColumn));
+	}
+}
+
+void TextEditor::AddCursorForNextOccurrence()
+{
+	if (!HasSelection())
+	{
+		auto pos = GetActualCursorCoordinates();
+		auto start = FindWordStart(pos);
+		auto end = FindWordEnd(pos);
+		if (start < end)
+		{
+			SetSelection(start, end);
+			SetCursorPosition(mState.mSelectionEnd);
+			MergeCursors();
+		}
+
+		return;
+	}
+
+	// The next match after the primary cursor becomes the primary one, matches selected already are skipped
+	const auto text = GetSelectedText();
+	Cursors cursors;
+	GetCursors(cursors);
+
+	auto from = mState.mSelectionEnd;
+	Coordinates start, end;
+	for (size_t i = 0; i <= cursors.size() && FindNext(text, from, start, end); ++i)
+	{
+		auto selected = std::find_if(cursors.begin(), cursors.end(),
+			[&](const EditorState& aState) { return aState.mSelectionStart == start && aState.mSelectionEnd == end; });
+		if (selected == cursors.end())
+		{
+			InsertExtraCursor(mState);
+			mState.mSelectionStart = start;
+			mState.mSelectionEnd = mState.mCursorPosition = end;
+			mInteractiveStart = start;
+			mInteractiveEnd = end;
+			mCursorPositionChanged = true;
+			MergeCursors();
+			EnsureCursorVisible();
+			return;
+		}
+
+		from = end;
+	}
+}
+
+void TextEditor::SplitSelectionIntoLines()
+{
+	// A selection over several lines becomes one per line, the cursors at their ends
+	Cursors cursors, split;
+	const auto primary = GetCursors(cursors);
+	size_t splitPrimary = 0;
+	for (size_t i = 0; i < cursors.size(); ++i)
+	{
+		auto& cursor = cursors[i];
+		if (i == primary)
+		{
+			splitPrimary = split.size();
+		}
+
+		const auto start = cursor.mSelectionStart;
+		const auto end = cursor.mSelectionEnd;
+		if (start.mLine == end.mLine)
+		{
+			split.push_back(cursor);
+			continue;
+		}
+
+		for (int line = start.mLine; line <= end.mLine && !(line == end.mLine && end.mColumn == 0); ++line)
+		{
+			EditorState state;
+			state.mSelectionStart = line == start.mLine ? start : Coordinates(line, 0);
+			state.mSelectionEnd = line == end.mLine ? end : Coordinates(line, GetLineMaxColumn(line));
+			state.mCursorPosition = state.mSelectionEnd;
+			split.push_back(state);
+		}
+	}
+
+	SetCursors(split, splitPrimary);
+	mInteractiveStart = mState.mSelectionStart;
+	mInteractiveEnd = mState.mSelectionEnd;
+	MergeCursors();
+}
+
+void TextEditor::ClearExtraCursors()
+{
+	mExtraCursors.clear();
+}
+
+size_t TextEditor::GetCursors(Cursors& aCursors) const
+{
+	// The extra cursors are kept sorted, only mState has to be put in place; its index is returned
+	auto state = mState;
+	state.CollapseEmptySelection();
+	auto it = std::lower_bound(mExtraCursors.begin(), mExtraCursors.end(), state.mSelectionStart,
+		[](const EditorState& aCursor, const Coordinates& aPosition) { return aCursor.mSelectionStart < aPosition; });
+	aCursors.assign(mExtraCursors.begin(), it);
+	aCursors.push_back(state);
+	aCursors.insert(aCursors.end(), it, mExtraCursors.end());
+	return (size_t)(it - mExtraCursors.begin());
+}
+
+void TextEditor::SetCursors(const Cursors& aCursors, size_t aPrimary)
+{
+	mState = aCursors[aPrimary];
+	mExtraCursors.assign(aCursors.begin(), aCursors.begin() + aPrimary);
+	mExtraCursors.insert(mExtraCursors.end(), aCursors.begin() + aPrimary + 1, aCursors.end());
+	mCursorPositionChanged = true;
+}
+
+void TextEditor::InsertExtraCursor(const EditorState& aState)
+{
+	auto state = aState;
+	state.CollapseEmptySelection();
+	auto it = std::lower_bound(mExtraCursors.begin(), mExtraCursors.end(), state.mSelectionStart,
+		[](const EditorState& aCursor, const Coordinates& aPosition) { return aCursor.mSelectionStart < aPosition; });
+	mExtraCursors.insert(it, state);
+}
+
+void TextEditor::MergeCursors()
+{
+	if (mExtraCursors.empty())
+	{
+		return;
+	}
+
+	// Cursors at the same position or with overlapping selections become one
+	Cursors cursors;
+	auto primary = GetCursors(cursors);
+	size_t count = 0;
+	for (size_t i = 0; i < cursors.size(); ++i)
+	{
+		auto& cursor = cursors[i];
+		if (count > 0)
+		{
+			auto& last = cursors[count - 1];
+			if (cursor.mSelectionStart < last.mSelectionEnd || cursor.mSelectionStart == last.mSelectionStart ||
+				cursor.mCursorPosition == last.mCursorPosition)
+			{
+				const bool atStart = last.mCursorPosition == last.mSelectionStart && cursor.mCursorPosition == cursor.mSelectionStart;
+				last.mSelectionEnd = std::max(last.mSelectionEnd, cursor.mSelectionEnd);
+				last.mCursorPosition = atStart ? last.mSelectionStart : last.mSelectionEnd;
+				if (i == primary)
+				{
+					primary = count - 1;
+				}
+
+				continue;
+			}
+		}
+
+		if (i == primary)
+		{
+			primary = count;
+		}
+
+		cursors[count++] = cursor;
+	}
+
+	if (count < cursors.size())
+	{
+		cursors.resize(count);
+		SetCursors(cursors, primary);
+	}
+}
+
+template <class Action>
+void TextEditor::ForEachCursor(Action aAction)
+{
+	if (mExtraCursors.empty())
+	{
+		aAction();
+		return;
+	}
+
+	// The cursors are put in mState in turn, from the bottom up. The edit at a cursor only changes the text before it,
+	// so the cursors done already are kept meanwhile as distances from the end of the text: lines, then bytes.
+	Cursors cursors;
+	const auto primary = GetCursors(cursors);
+	mExtraCursors.clear();
+
+	typedef std::pair<int, int> Anchor;
+	auto toAnchor = [this](const Coordinates& aPosition)
+	{
+		auto pos = SanitizeCoordinates(aPosition);
+		return Anchor((int)mLines.size() - 1 - pos.mLine, (int)mLines[pos.mLine].size() - GetCharacterIndex(pos));
+	};
+	auto fromAnchor = [this](const Anchor& aAnchor)
+	{
+		const int line = std::max(0, (int)mLines.size() - 1 - aAnchor.first);
+		const int index = std::max(0, (int)mLines[line].size() - aAnchor.second);
+		return Coordinates(line, GetCharacterColumn(line, index));
+	};
+
+	std::vector<std::array<Anchor, 3>> anchors(cursors.size());
+	for (size_t i = cursors.size(); i-- > 0; )
+	{
+		mState = cursors[i];
+		mInteractiveStart = mState.mSelectionStart;
+		mInteractiveEnd = mState.mSelectionEnd;
+		aAction();
+
+		// An empty selection may be left behind where the cursor was
+		if (mState.mSelectionStart == mState.mSelectionEnd)
+		{
+			mState.mSelectionStart = mState.mSelectionEnd = mState.mCursorPosition;
+		}
+
+		anchors[i] = {{ toAnchor(mState.mCursorPosition), toAnchor(mState.mSelectionStart), toAnchor(mState.mSelectionEnd) }};
+	}
+
+	for (size_t i = 0; i < cursors.size(); ++i)
+	{
+		cursors[i].mCursorPosition = fromAnchor(anchors[i][0]);
+		cursors[i].mSelectionStart = fromAnchor(anchors[i][1]);
+		cursors[i].mSelectionEnd = fromAnchor(anchors[i][2]);
+	}
+
+	SetCursors(cursors, primary);
+	MergeCursors();
+	mInteractiveStart = mState.mSelectionStart;
+	mInteractiveEnd = mState.mSelectionEnd;
+	EnsureCursorVisible();
+}
+
+template <class Action>
+void TextEditor::EditCursors(Action aAction)
+{
+	if (mUndoBatch != nullptr)
+	{
+		ForEachCursor(aAction);
+		return;
+	}
+
+	// The edits at every cursor make a single undo record
+	UndoRecord u;
+	u.mBefore = mState;
+	u.mExtraBefore = mExtraCursors;
+
+	mUndoBatch = &u;
+	ForEachCursor(aAction);
+	mUndoBatch = nullptr;
+
+	if (!u.mEdits.empty())
+	{
+		u.mAfter = mState;
+		u.mExtraAfter = mExtraCursors;
+		AddUndo(u);
+	}
+}
+
+template <class Action>
+void TextEditor::EditLines(Action aAction)
+{
+	if (IsReadOnly() || mLines.empty())
+	{
+		return;
+	}
+
+	// The lines of the cursors, with the lines of cursors on the same or adjacent lines made into one block.
+	// The positions of a block are handed to the action along with it; every position lies within the block,
+	// or at the start of the line after it.
+	struct Block
+	{
+		int mFirst;
+		int mEnd;
+		size_t mPositions;
+		int mAdded; // Lines added by the action, negative if removed
+	};
+
+	Cursors cursors;
+	const auto primary = GetCursors(cursors);
+	std::vector<Block> blocks;
+	std::vector<LinePosition> positions;
+	for (auto& cursor : cursors)
+	{
+		const auto start = SanitizeCoordinates(cursor.mSelectionStart);
+		const auto end = SanitizeCoordinates(cursor.mSelectionEnd);
+		const int last = (end.mColumn == 0 && end.mLine > start.mLine) ? end.mLine - 1 : end.mLine;
+		if (blocks.empty() || start.mLine > blocks.back().mEnd)
+		{
+			Block block = { start.mLine, last + 1, positions.size(), 0 };
+			blocks.push_back(block);
+		}
+		else
+		{
+			blocks.back().mEnd = std::max(blocks.back().mEnd, last + 1);
+		}
+
+		for (auto& position : { cursor.mCursorPosition, start, end })
+		{
+			auto pos = SanitizeCoordinates(position);
+			positions.push_back(LinePosition(pos.mLine, GetCharacterIndex(pos)));
+		}
+	}
+
+	UndoRecord u;
+	const bool batched = mUndoBatch != nullptr;
+	if (!batched)
+	{
+		u.mBefore = mState;
+		u.mExtraBefore = mExtraCursors;
+		mUndoBatch = &u;
+	}
+
+	// From the bottom up, so the lines of the blocks left are not moved
+	for (size_t i = blocks.size(); i-- > 0; )
+	{
+		auto& block = blocks[i];
+		const size_t end = i + 1 < blocks.size() ? blocks[i + 1].mPositions : positions.size();
+		LinePositions range = { positions.data() + block.mPositions, positions.data() + end };
+		block.mAdded = aAction(block.mFirst, block.mEnd, range);
+	}
+
+	int added = 0;
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		const size_t end = i + 1 < blocks.size() ? blocks[i + 1].mPositions : positions.size();
+		for (size_t j = blocks[i].mPositions; j < end; ++j)
+		{
+			positions[j].first += added;
+		}
+
+		added += blocks[i].mAdded;
+	}
+
+	for (size_t i = 0; i < cursors.size(); ++i)
+	{
+		Coordinates* target[] = { &cursors[i].mCursorPosition, &cursors[i].mSelectionStart, &cursors[i].mSelectionEnd };
+		for (int j = 0; j < 3; ++j)
+		{
+			const auto& pos = positions[i * 3 + j];
+			const int line = std::max(0, std::min(pos.first, (int)mLines.size() - 1));
+			const int index = std::max(0, std::min(pos.second, (int)mLines[line].size()));
+			*target[j] = Coordinates(line, GetCharacterColumn(line, index));
+		}
+	}
+
+	SetCursors(cursors, primary);
+	MergeCursors();
+	mInteractiveStart = mState.mSelectionStart;
+	mInteractiveEnd = mState.mSelectionEnd;
+
+	if (!batched)
+	{
+		mUndoBatch = nullptr;
+		if (!u.mEdits.empty())
+		{
+			u.mAfter = mState;
+			u.mExtraAfter = mExtraCursors;
+			AddUndo(u);
+		}
+	}
+
+	EnsureCursorVisible();
+}
+
+void TextEditor::BeginLineEdit(UndoRecord& aRecord, int aFirst, int aEnd) const
+{
+	aRecord.mRemovedStart = Coordinates(aFirst, 0);
+	aRecord.mRemovedEnd = Coordinates(aEnd - 1, GetLineMaxColumn(aEnd - 1));
+	aRecord.mRemoved = GetText(aRecord.mRemovedStart, aRecord.mRemovedEnd);
+}
+
+void TextEditor::EndLineEdit(UndoRecord& aRecord, int aFirst, int aEnd)
+{
+	if (aEnd > aFirst)
+	{
+		aRecord.mAddedStart = Coordinates(aFirst, 0);
+		aRecord.mAddedEnd = Coordinates(aEnd - 1, GetLineMaxColumn(aEnd - 1));
+		aRecord.mAdded = GetText(aRecord.mAddedStart, aRecord.mAddedEnd);
+		aRecord.mByLine = aRecord.mRemovedStart == aRecord.mAddedStart && aRecord.mRemovedEnd.mLine == aRecord.mAddedEnd.mLine;
+	}
+	else if (aFirst < (int)mLines.size())
+	{
+		// All the lines were removed: the edit takes the line break after them, or before them at the end of the text
+		aRecord.mRemoved += '\n';
+		aRecord.mRemovedEnd = Coordinates(aRecord.mRemovedEnd.mLine + 1, 0);
+		aRecord.mAddedStart = aRecord.mAddedEnd = aRecord.mRemovedStart;
+	}
+	else
+	{
+		aRecord.mRemoved.insert(0, 1, '\n');
+		aRecord.mRemovedStart = Coordinates(aFirst - 1, GetLineMaxColumn(aFirst - 1));
+		aRecord.mAddedStart = aRecord.mAddedEnd = aRecord.mRemovedStart;
+	}
+
+	for (int i = aFirst; i < aEnd; ++i)
+	{
+		mLineWidths.MarkDirty(i);
+	}
+
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(aFirst, aEnd);
+	Colorize(aFirst - 1, aEnd - aFirst + 2);
+	if (aRecord.mAdded != aRecord.mRemoved)
+	{
+		AddUndo(aRecord);
+	}
+}
+
+void TextEditor::MoveLinesUp()
+{
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		if (aFirst == 0)
+		{
+			return 0;
+		}
+
+		// The line above goes below the block
+		LineOrder order(aEnd - aFirst + 1);
+		for (int i = 0; i < (int)order.size(); ++i)
+		{
+			order[i] = (i + 1) % (int)order.size();
+		}
+
+		MoveLines(aFirst - 1, order);
+		for (auto& p : aPositions)
+		{
+			--p.first;
+		}
+
+		return 0;
+	});
+}
+
+void TextEditor::MoveLinesDown()
+{
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		if (aEnd >= (int)mLines.size())
+		{
+			return 0;
+		}
+
+		// The line below goes above the block
+		LineOrder order(aEnd - aFirst + 1);
+		for (int i = 0; i < (int)order.size(); ++i)
+		{
+			order[i] = (i + (int)order.size() - 1) % (int)order.size();
+		}
+
+		MoveLines(aFirst, order);
+		for (auto& p : aPositions)
+		{
+			++p.first;
+		}
+
+		return 0;
+	});
+}
+
+void TextEditor::DuplicateLines()
+{
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		// The copies go below, and the cursors with them. Only the copies are recorded as added, so undoing
+		// the duplication leaves the lines of the block as they are.
+		const int count = aEnd - aFirst;
+		UndoRecord u;
+		u.mAdded = GetText(Coordinates(aFirst, 0), Coordinates(aEnd - 1, GetLineMaxColumn(aEnd - 1)));
+		if (aEnd < (int)mLines.size())
+		{
+			u.mAdded += '\n';
+			u.mAddedStart = Coordinates(aEnd, 0);
+			u.mAddedEnd = Coordinates(aEnd + count, 0);
+		}
+		else
+		{
+			u.mAdded.insert(0, 1, '\n');
+			u.mAddedStart = Coordinates(aEnd - 1, GetLineMaxColumn(aEnd - 1));
+		}
+
+		Lines copies(mLines.begin() + aFirst, mLines.begin() + aEnd);
+		for (auto& line : copies)
+		{
+			line.mMarkerSlot = 0;
+			line.Touch();
+		}
+
+		mLines.insert(mLines.begin() + aEnd, std::make_move_iterator(copies.begin()), std::make_move_iterator(copies.end()));
+		mLineWidths.InsertLines(aEnd, count);
+		mDiagnostics.InsertLines(aEnd, count);
+		AttachMarkers();
+		for (auto& p : aPositions)
+		{
+			p.first += count;
+		}
+
+		for (int i = aEnd; i < aEnd + count; ++i)
+		{
+			mLineWidths.MarkDirty(i);
+		}
+
+		if (aEnd + count == (int)mLines.size())
+		{
+			u.mAddedEnd = Coordinates(aEnd + count - 1, GetLineMaxColumn(aEnd + count - 1));
+		}
+
+		mTextChanged = true;
+		++mTextRevision;
+		InvalidateFindMatches(aEnd, aEnd + count);
+		Colorize(aEnd - 1, count + 2);
+		AddUndo(u);
+		return count;
+	});
+}
+
+void TextEditor::DeleteLines()
+{
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		UndoRecord u;
+		BeginLineEdit(u, aFirst, aEnd);
+
+		// One empty line is left of the whole text
+		int end = aFirst;
+		if (aEnd - aFirst == (int)mLines.size())
+		{
+			RemoveLine(aFirst + 1, aEnd);
+			ReleaseLineMarkers(mLines[aFirst]);
+			mLines[aFirst].clear();
+			mLines[aFirst].Touch();
+			end = aFirst + 1;
+		}
+		else
+		{
+			RemoveLine(aFirst, aEnd);
+		}
+
+		for (auto& p : aPositions)
+		{
+			p.first = aFirst;
+		}
+
+		EndLineEdit(u, aFirst, end);
+		return end - aEnd;
+	});
+}
+
+void TextEditor::SortLines(bool aUnique)
+{
+	EditLines([this, aUnique](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		const int count = aEnd - aFirst;
+		if (count < 2)
+		{
+			return 0;
+		}
+
+		auto less = [](const Glyph& a, const Glyph& b) { return a.mChar < b.mChar; };
+		auto equal = [](const Glyph& a, const Glyph& b) { return a.mChar == b.mChar; };
+		auto line = [this, aFirst](int aOffset) -> const Line& { return mLines[aFirst + aOffset]; };
+		LineOrder order(count);
+		for (int i = 0; i < count; ++i)
+		{
+			order[i] = i;
+		}
+
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+		{
+			return std::lexicographical_compare(line(a).begin(), line(a).end(), line(b).begin(), line(b).end(), less);
+		});
+
+		// A repeated line goes after the sorted ones, to be removed with its markers
+		int end = aEnd;
+		if (aUnique)
+		{
+			LineOrder kept;
+			LineOrder repeated;
+			for (int i = 0; i < count; ++i)
+			{
+				const auto& a = line(order[i]);
+				const bool repeats = i > 0 && a.size() == line(order[i - 1]).size() &&
+					std::equal(a.begin(), a.end(), line(order[i - 1]).begin(), equal);
+				(repeats ? repeated : kept).push_back(order[i]);
+			}
+
+			end = aFirst + (int)kept.size();
+			kept.insert(kept.end(), repeated.begin(), repeated.end());
+			order.swap(kept);
+		}
+
+		// The lines are moved, not copied, so they keep their markers, and undo moves them back
+		if (!std::is_sorted(order.begin(), order.end()))
+		{
+			MoveLines(aFirst, order);
+		}
+
+		if (end < aEnd)
+		{
+			UndoRecord u;
+			BeginLineEdit(u, end, aEnd);
+			RemoveLine(end, aEnd);
+			EndLineEdit(u, end, end);
+		}
+
+		// The cursors stay on their lines, so a selection still covers the block
+		for (auto& p : aPositions)
+		{
+			p.first = p.first < aEnd ? std::min(p.first, end - 1) : end;
+		}
+
+		return end - aEnd;
+	});
+}
+
+void TextEditor::ToggleLineComment()
+{
+	if (mLanguageDefinition.mSingleLineComment.empty())
+	{
+		return;
+	}
+
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		const auto& comment = mLanguageDefinition.mSingleLineComment;
+		const int length = (int)comment.size();
+		auto isBlank = [](Char c) { return c == ' ' || c == '\t'; };
+		auto indentOf = [&](const Line& aLine)
+		{
+			int i = 0;
+			while (i < (int)aLine.size() && isBlank(aLine[i].mChar))
+			{
+				++i;
+			}
+
+			return i;
+		};
+		auto isCommented = [&](const Line& aLine, int aIndex)
+		{
+			if ((int)aLine.size() - aIndex < length)
+			{
+				return false;
+			}
+
+			for (int i = 0; i < length; ++i)
+			{
+				if (aLine[aIndex + i].mChar != (Char)comment[i])
+				{
+					return false;
+				}
+			}
+
+			return true;
+		};
+
+		// Uncommented if every line that is not blank is commented, otherwise commented at the smallest indentation
+		bool commented = true;
+		int indent = std::numeric_limits<int>::max();
+		for (int i = aFirst; i < aEnd; ++i)
+		{
+			const int at = indentOf(mLines[i]);
+			if (at < (int)mLines[i].size())
+			{
+				indent = std::min(indent, at);
+				commented = commented && isCommented(mLines[i], at);
+			}
+		}
+
+		if (indent == std::numeric_limits<int>::max())
+		{
+			return 0;
+		}
+
+		std::vector<Glyph> glyphs;
+		for (auto c : comment + ' ')
+		{
+			glyphs.push_back(Glyph((Char)c, PaletteIndex::Comment));
+		}
+
+		UndoRecord u;
+		BeginLineEdit(u, aFirst, aEnd);
+
+		// The byte index and count of the glyphs each line got, negative if removed
+		std::vector<std::pair<int, int>> changes(aEnd - aFirst, std::make_pair(0, 0));
+		for (int i = aFirst; i < aEnd; ++i)
+		{
+			auto& line = mLines[i];
+			const int at = indentOf(line);
+			if (at == (int)line.size())
+			{
+				continue;
+			}
+
+			if (commented)
+			{
+				const int removed = length + (at + length < (int)line.size() && line[at + length].mChar == ' ' ? 1 : 0);
+				line.erase(line.begin() + at, line.begin() + at + removed);
+				changes[i - aFirst] = std::make_pair(at, -removed);
+			}
+			else
+			{
+				line.insert(line.begin() + indent, glyphs.begin(), glyphs.end());
+				changes[i - aFirst] = std::make_pair(indent, (int)glyphs.size());
+			}
+
+			line.Touch();
+		}
+
+		ShiftLinePositions(aPositions, aFirst, aEnd, changes);
+		EndLineEdit(u, aFirst, aEnd);
+		return 0;
+	});
+}
+
+void TextEditor::IndentLines()
+{
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		UndoRecord u;
+		BeginLineEdit(u, aFirst, aEnd);
+
+		const Glyph tab('\t', PaletteIndex::Background);
+		for (int i = aFirst; i < aEnd; ++i)
+		{
+			mLines[i].insert(mLines[i].begin(), tab);
+			mLines[i].Touch();
+		}
+
+		std::vector<std::pair<int, int>> changes(aEnd - aFirst, std::make_pair(0, 1));
+		ShiftLinePositions(aPositions, aFirst, aEnd, changes);
+		EndLineEdit(u, aFirst, aEnd);
+		return 0;
+	});
+}
+
+void TextEditor::UnindentLines()
+{
+	EditLines([this](int aFirst, int aEnd, LinePositions aPositions) -> int
+	{
+		// A tab, or up to a tab's worth of spaces
+		std::vector<std::pair<int, int>> changes(aEnd - aFirst, std::make_pair(0, 0));
+		bool modified = false;
+		for (int i = aFirst; i < aEnd; ++i)
+		{
+			auto& line = mLines[i];
+			int count = 0;
+			if (!line.empty() && line.front().mChar == '\t')
+			{
+				count = 1;
+			}
+			else
+			{
+				while (count < mTabSize && count < (int)line.size() && line[count].mChar == ' ')
+				{
+					++count;
+				}
+			}
+
+			changes[i - aFirst].second = -count;
+			modified = modified || count > 0;
+		}
+
+		if (!modified)
+		{
+			return 0;
+		}
+
+		UndoRecord u;
+		BeginLineEdit(u, aFirst, aEnd);
+		for (int i = aFirst; i < aEnd; ++i)
+		{
+			auto& line = mLines[i];
+			if (changes[i - aFirst].second != 0)
+			{
+				line.erase(line.begin(), line.begin() - changes[i - aFirst].second);
+				line.Touch();
+			}
+		}
+
+		ShiftLinePositions(aPositions, aFirst, aEnd, changes);
+		EndLineEdit(u, aFirst, aEnd);
+		return 0;
+	});
+}
+
+void TextEditor::ShiftLinePositions(LinePositions aPositions, int aFirst, int aEnd, const std::vector<std::pair<int, int>>& aChanges)
+{
+	// Positions at an insertion move past it, except at the start of the line, which keeps whole lines selected
+	for (auto& p : aPositions)
+	{
+		if (p.first < aFirst || p.first >= aEnd)
+		{
+			continue;
+		}
+
+		const auto& change = aChanges[p.first - aFirst];
+		if (p.second > change.first || (p.second == change.first && change.first > 0 && change.second > 0))
+		{
+			p.second = std::max(change.first, p.second + change.second);
+		}
+	}
+}
+
+bool TextEditor::FindNext(const std::string& aText, const Coordinates& aFrom, Coordinates& aStart, Coordinates& aEnd) const
+{
+	if (aText.empty() || mLines.empty())
+	{
+		return false;
+	}
+
+	// Byte by byte from aFrom, wrapping around to the top of the text
+	const auto from = SanitizeCoordinates(aFrom);
+	const int fromIndex = GetCharacterIndex(from);
+	const int lineCount = (int)mLines.size();
+	for (int i = 0; i <= lineCount; ++i)
+	{
+		const int line = (from.mLine + i) % lineCount;
+		const int first = i == 0 ? fromIndex : 0;
+		const int last = i == lineCount ? fromIndex : (int)mLines[line].size();
+		for (int index = first; index <= last; ++index)
+		{
+			int matchLine = line;
+			int matchIndex = index;
+			size_t k = 0;
+			for (; k < aText.size(); ++k)
+			{
+				auto& glyphs = mLines[matchLine];
+				if (matchIndex < (int)glyphs.size() && glyphs[matchIndex].mChar == (Char)aText[k])
+				{
+					++matchIndex;
+				}
+				else if (matchIndex == (int)glyphs.size() && aText[k] == '\n' && matchLine + 1 < lineCount)
+				{
+					++matchLine;
+					matchIndex = 0;
+				}
+				else
+				{
+					break;
+				}
+			}
+
+			if (k == aText.size())
+			{
+				aStart = Coordinates(line, GetCharacterColumn(line, index));
+				aEnd = Coordinates(matchLine, GetCharacterColumn(matchLine, matchIndex));
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void TextEditor::SetFindText(const std::string& aText, bool aMatchCase)
+{
+	mFindText = aText;
+	mFindMatchCase = aMatchCase;
+	FindMatches();
+}
+
+int TextEditor::GetFindMatchCount() const
+{
+	UpdateFindMatches();
+	return (int)mFindMatches.size();
+}
+
+bool TextEditor::GetFindMatch(int aIndex, Coordinates& aStart, Coordinates& aEnd) const
+{
+	UpdateFindMatches();
+	if (aIndex < 0 || aIndex >= (int)mFindMatches.size())
+	{
+		return false;
+	}
+
+	auto& match = mFindMatches[aIndex];
+	aStart = Coordinates(match.mStart.first, GetCharacterColumn(match.mStart.first, match.mStart.second));
+	aEnd = Coordinates(match.mEnd.first, GetCharacterColumn(match.mEnd.first, match.mEnd.second));
+	return true;
+}
+
+int TextEditor::GetFindMatchIndex() const
+{
+	if (!HasSelection())
+	{
+		return -1;
+	}
+
+	UpdateFindMatches();
+	const LinePosition start(mState.mSelectionStart.mLine, GetCharacterIndex(mState.mSelectionStart));
+	const LinePosition end(mState.mSelectionEnd.mLine, GetCharacterIndex(mState.mSelectionEnd));
+	auto it = std::lower_bound(mFindMatches.begin(), mFindMatches.end(), start,
+		[](const FindMatch& aMatch, const LinePosition& aPosition) { return aMatch.mStart < aPosition; });
+	return it != mFindMatches.end() && it->mStart == start && it->mEnd == end ? (int)(it - mFindMatches.begin()) : -1;
+}
+
+bool TextEditor::FindNextMatch()
+{
+	UpdateFindMatches();
+	if (mFindMatches.empty())
+	{
+		return false;
+	}
+
+	// The first match from the end of the selection on
+	const auto from = SanitizeCoordinates(HasSelection() ? mState.mSelectionEnd : GetActualCursorCoordinates());
+	const LinePosition position(from.mLine, GetCharacterIndex(from));
+	auto it = std::lower_bound(mFindMatches.begin(), mFindMatches.end(), position,
+		[](const FindMatch& aMatch, const LinePosition& aPosition) { return aMatch.mStart < aPosition; });
+	SelectFindMatch(it != mFindMatches.end() ? *it : mFindMatches.front());
+	return true;
+}
+
+bool TextEditor::FindPreviousMatch()
+{
+	UpdateFindMatches();
+	if (mFindMatches.empty())
+	{
+		return false;
+	}
+
+	// The last match that starts before the selection
+	const auto from = SanitizeCoordinates(HasSelection() ? mState.mSelectionStart : GetActualCursorCoordinates());
+	const LinePosition position(from.mLine, GetCharacterIndex(from));
+	auto it = std::lower_bound(mFindMatches.begin(), mFindMatches.end(), position,
+		[](const FindMatch& aMatch, const LinePosition& aPosition) { return aMatch.mStart < aPosition; });
+	SelectFindMatch(it != mFindMatches.begin() ? *(it - 1) : mFindMatches.back());
+	return true;
+}
+
+void TextEditor::FindMatches() const
+{
+	mFindMatches.clear();
+	FindMatches(0, (int)mLines.size(), LinePosition(0, 0), mFindMatches);
+	mFindRevision = mTextRevision;
+	mFindLineCount = (int)mLines.size();
+	mFindChangesRevision = mTextRevision;
+	mFindChangedFirst = mFindUnchangedTail = std::numeric_limits<int>::max();
+}
+
+void TextEditor::FindMatches(int aFirstLine, int aEndLine, LinePosition aNext, FindMatchList& aMatches) const
+{
+	// Appends the matches starting on the lines; a match with line breaks may not start before aNext, where the
+	// match before them ended
+	// Byte values are compared through this table, which folds ASCII letters to lower case to ignore their case
+	uint8_t fold[256];
+	for (int c = 0; c < 256; ++c)
+	{
+		fold[c] = (uint8_t)(!mFindMatchCase && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+	}
+
+	// The text to find, folded and split at its line breaks
+	std::vector<std::string> parts(1);
+	for (auto c : mFindText)
+	{
+		if (c == '\n')
+		{
+			parts.emplace_back();
+		}
+		else if (c != '\r')
+		{
+			parts.back() += (char)fold[(uint8_t)c];
+		}
+	}
+
+	auto equals = [&](const Line& aLine, int aIndex, const std::string& aPart)
+	{
+		for (size_t i = 0; i < aPart.size(); ++i)
+		{
+			if (fold[(uint8_t)aLine[aIndex + i].mChar] != (uint8_t)aPart[i])
+			{
+				return false;
+			}
+		}
+
+		return true;
+	};
+
+	const int lineCount = (int)mLines.size();
+	if (parts.size() == 1)
+	{
+		const auto& part = parts.front();
+		const int size = (int)part.size();
+		if (size == 0)
+		{
+			return;
+		}
+
+		// Candidates are found with memchr(), which is vectorized, looking for the first byte (in either case) through
+		// the memory of the glyphs; only the bytes at the offset of mChar in a glyph are characters
+		const int first = (uint8_t)part.front();
+		const int upper = !mFindMatchCase && first >= 'a' && first <= 'z' ? first - 'a' + 'A' : -1;
+		for (int line = aFirstLine; line < aEndLine; ++line)
+		{
+			auto& glyphs = mLines[line];
+			const auto bytes = reinterpret_cast<const uint8_t*>(glyphs.data());
+			const auto bytesEnd = bytes + glyphs.size() * sizeof(Glyph);
+			auto scan = [&](int aByte, const uint8_t* aFrom)
+			{
+				auto found = aByte < 0 || aFrom >= bytesEnd ? nullptr : memchr(aFrom, aByte, bytesEnd - aFrom);
+				return found != nullptr ? static_cast<const uint8_t*>(found) : bytesEnd;
+			};
+
+			auto lower = scan(first, bytes);
+			auto other = scan(upper, bytes);
+			for (auto p = std::min(lower, other); p != bytesEnd; p = std::min(lower, other))
+			{
+				auto from = p + 1;
+				const size_t offset = p - bytes;
+				if (offset % sizeof(Glyph) == offsetof(Glyph, mChar))
+				{
+					const int index = (int)(offset / sizeof(Glyph));
+					if (index + size <= (int)glyphs.size() && equals(glyphs, index, part))
+					{
+						aMatches.emplace_back(LinePosition(line, index), LinePosition(line, index + size));
+						from = bytes + (index + size) * sizeof(Glyph);
+					}
+				}
+
+				if (lower < from)
+				{
+					lower = scan(first, from);
+				}
+
+				if (other < from)
+				{
+					other = scan(upper, from);
+				}
+			}
+		}
+	}
+	else
+	{
+		// Only the end of a line can hold the first part, and the next lines have to hold the others
+		const int count = (int)parts.size() - 1;
+		LinePosition next = aNext; // Where the last match ended
+		for (int line = aFirstLine; line < aEndLine && line + count < lineCount; ++line)
+		{
+			const LinePosition start(line, (int)mLines[line].size() - (int)parts.front().size());
+			if (start.second < 0 || start < next || !equals(mLines[line], start.second, parts.front()))
+			{
+				continue;
+			}
+
+			bool match = true;
+			for (int i = 1; i < count && match; ++i)
+			{
+				match = mLines[line + i].size() == parts[i].size() && equals(mLines[line + i], 0, parts[i]);
+			}
+
+			if (match && mLines[line + count].size() >= parts.back().size() && equals(mLines[line + count], 0, parts.back()))
+			{
+				next = LinePosition(line + count, (int)parts.back().size());
+				aMatches.emplace_back(start, next);
+			}
+		}
+	}
+}
+
+void TextEditor::UpdateFindMatches() const
+{
+	if (mFindRevision == mTextRevision)
+	{
+		return;
+	}
+
+	// Unless a change was not reported, only the changed lines are searched again, along with the lines before them
+	// that a match with line breaks could start on. The matches after them are moved by the lines added or removed.
+	if (mFindChangesRevision != mTextRevision)
+	{
+		FindMatches();
+		return;
+	}
+
+	const int lineCount = (int)mLines.size();
+	const int lineBreaks = (int)std::count(mFindText.begin(), mFindText.end(), '\n');
+	const int first = std::max(0, std::min(mFindChangedFirst, lineCount) - lineBreaks);
+	const int end = std::max(first, lineCount - mFindUnchangedTail);
+	const int oldEnd = std::max(first, mFindLineCount - mFindUnchangedTail);
+	const int added = lineCount - mFindLineCount;
+
+	auto before = [](const FindMatch& aMatch, int aLine) { return aMatch.mStart.first < aLine; };
+	auto changed = std::lower_bound(mFindMatches.begin(), mFindMatches.end(), first, before);
+	auto unchanged = std::lower_bound(changed, mFindMatches.end(), oldEnd, before);
+	for (auto it = unchanged; it != mFindMatches.end(); ++it)
+	{
+		it->mStart.first += added;
+		it->mEnd.first += added;
+	}
+
+	mFindChangedMatches.clear();
+	const auto next = changed != mFindMatches.begin() ? (changed - 1)->mEnd : LinePosition(0, 0);
+	FindMatches(first, end, next, mFindChangedMatches);
+
+	// A match with line breaks found in the changed lines may overlap the next one, e.g. "a\na" in lines of "a"
+	const auto last = mFindChangedMatches.empty() ? next : mFindChangedMatches.back().mEnd;
+	if (lineBreaks > 0 && unchanged != mFindMatches.end() && unchanged->mStart < last)
+	{
+		FindMatches();
+		return;
+	}
+
+	const auto at = mFindMatches.erase(changed, unchanged);
+	mFindMatches.insert(at, mFindChangedMatches.begin(), mFindChangedMatches.end());
+	mFindRevision = mTextRevision;
+	mFindLineCount = lineCount;
+	mFindChangedFirst = mFindUnchangedTail = std::numeric_limits<int>::max();
+}
+
+void TextEditor::InvalidateFindMatches(int aFirst, int aEnd)
+{
+	// Called after each change of the text with the lines it changed; a change not reported makes the next search
+	// go through the whole text
+	if (mFindChangesRevision + 1 == mTextRevision)
+	{
+		mFindChangesRevision = mTextRevision;
+		mFindChangedFirst = std::min(mFindChangedFirst, aFirst);
+		mFindUnchangedTail = std::min(mFindUnchangedTail, (int)mLines.size() - aEnd);
+	}
+}
+
+void TextEditor::SelectFindMatch(const FindMatch& aMatch)
+{
+	const Coordinates start(aMatch.mStart.first, GetCharacterColumn(aMatch.mStart.first, aMatch.mStart.second));
+	const Coordinates end(aMatch.mEnd.first, GetCharacterColumn(aMatch.mEnd.first, aMatch.mEnd.second));
+
+	mExtraCursors.clear();
+	mState.mSelectionStart = start;
+	mState.mSelectionEnd = mState.mCursorPosition = end;
+	mInteractiveStart = start;
+	mInteractiveEnd = end;
+	mCursorPositionChanged = true;
+	EnsureCursorVisible();
+}
+
+void TextEditor::HandleKeyboardInputs()
+{
+	if (ImGui::IsWindowFocused())
+	{
+		if (ImGui::IsWindowHovered())
+			ImGui::SetMouseCursor(ImGuiMouseCursor_TextInput);
+		//ImGui::CaptureKeyboardFromApp(true);
+
+		ImGuiIO& io = ImGui::GetIO();
+		auto isOSX = io.ConfigMacOSXBehaviors;
+		auto alt = io.KeyAlt;
+		auto ctrl = io.KeyCtrl;
+		auto shift = io.KeyShift;
+		auto super = io.KeySuper;
+
+		auto isShortcut = (isOSX ? (super && !ctrl) : (ctrl && !super)) && !alt && !shift;
+		auto isShiftShortcut = (isOSX ? (super && !ctrl) : (ctrl && !super)) && shift && !alt;
+		auto isWordmoveKey = isOSX ? alt : ctrl;
+		auto isAltOnly = alt && !ctrl && !shift && !super;
+		auto isCtrlOnly = ctrl && !alt && !shift && !super;
+		auto isShiftOnly = shift && !alt && !ctrl && !super;
+
+		io.WantCaptureKeyboard = true;
+		io.WantTextInput = true;
+
+		if (!IsReadOnly() && isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)))
+		{
+			Undo();
+		}
+		else if (!IsReadOnly() && isAltOnly && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Backspace)))
+		{
+			Undo();
 		}
 		else if (!IsReadOnly() && isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Y)))
 		{
-			Redo();
+			Redo();
+		}
+		else if (!IsReadOnly() && isShiftShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)))
+		{
+			Redo();
+		}
+		else if (ctrl && alt && !shift && !super && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_UpArrow)))
+		{
+			AddCursorAbove();
+		}
+		else if (ctrl && alt && !shift && !super && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_DownArrow)))
+		{
+			AddCursorBelow();
+		}
+#if IMGUI_VERSION_NUM >= 18700 // Letter keys other than those of the clipboard and undo shortcuts came with ImGui 1.87
+		else if (isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_D)))
+		{
+			AddCursorForNextOccurrence();
+		}
+		else if (alt && shift && !ctrl && !super && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_I)))
+		{
+			SplitSelectionIntoLines();
+		}
+#endif
+		else if (!IsReadOnly() && isAltOnly && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_UpArrow)))
+		{
+			MoveLinesUp();
+		}
+		else if (!IsReadOnly() && isAltOnly && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_DownArrow)))
+		{
+			MoveLinesDown();
 		}
-		else if (!IsReadOnly() && isShiftShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)))
+		else if (!IsReadOnly() && alt && shift && !ctrl && !super && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_DownArrow)))
 		{
-			Redo();
+			DuplicateLines();
+		}
+#if IMGUI_VERSION_NUM >= 18700
+		else if (!IsReadOnly() && isShiftShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_K)))
+		{
+			DeleteLines();
+		}
+		else if (!IsReadOnly() && isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Slash)))
+		{
+			ToggleLineComment();
+		}
+		else if (!IsReadOnly() && isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_RightBracket)))
+		{
+			IndentLines();
+		}
+		else if (!IsReadOnly() && isShortcut && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_LeftBracket)))
+		{
+			UnindentLines();
+		}
+#endif
+		else if (!mExtraCursors.empty() && !alt && !ctrl && !shift && !super && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Escape)))
+		{
+			ClearExtraCursors();
 		}
 		else if (!alt && !ctrl && !super && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_UpArrow)))
 		{
@@ -975,15 +3150,26 @@ void TextEditor::HandleKeyboardInputs()
 		
 		if (!IsReadOnly() && !io.InputQueueCharacters.empty() && !ctrl && !super)
 		{
+			// The characters queued in a frame are entered as one edit; line breaks on their own, for auto-indentation
+			std::string typed;
 			for (int i = 0; i < io.InputQueueCharacters.Size; i++)
 			{
 				auto c = io.InputQueueCharacters[i];
-				if (c != 0 && (c == '\n' || c >= 32))
+				if (c == '\n')
 				{
+					EnterText(typed);
+					typed.clear();
 					EnterCharacter(c, shift);
 				}
+				else if (c >= 32)
+				{
+					char buf[7];
+					typed.append(buf, std::max(0, ImTextCharToUtf8(buf, 7, c)));
+				}
 			}
 
+			EnterText(typed);
+
 			io.InputQueueCharacters.resize(0);
 		}
 	}
@@ -1040,6 +3226,7 @@ void TextEditor::HandleMouseInputs()
 			// Left mouse button click
 			else if (click)
 			{
+				mExtraCursors.clear();
 				mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
 				if (ctrl)
 				{
@@ -1062,267 +3249,347 @@ void TextEditor::HandleMouseInputs()
 				SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
 			}
 		}
+		// Alt + left mouse button click adds a cursor
+		else if (alt && !shift && ImGui::IsMouseClicked(0))
+		{
+			AddCursor(ScreenPosToCoordinates(ImGui::GetMousePos()));
+		}
 	}
 }
 
 void TextEditor::Render()
 {
-	// Compute mCharAdvance regarding to scaled font size (Ctrl + mouse wheel)
-	const float fontSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, "#", nullptr, nullptr).x;
-	mCharAdvance = ImVec2(fontSize, ImGui::GetTextLineHeightWithSpacing() * mLineSpacing);
-
 	// Update palette with the current alpha from style
+	Palette palette;
 	for (int i = 0; i < (int)PaletteIndex::Max; ++i)
 	{
 		auto color = ImGui::ColorConvertU32ToFloat4(mPaletteBase[i]);
 		color.w *= ImGui::GetStyle().Alpha;
-		mPalette[i] = ImGui::ColorConvertFloat4ToU32(color);
+		palette[i] = ImGui::ColorConvertFloat4ToU32(color);
 	}
 
-	assert(mLineBuffer.empty());
+	if (palette != mPalette)
+	{
+		mPalette = palette;
+		++mPaletteRevision;
+	}
 
 	auto contentSize = ImGui::GetWindowContentRegionMax();
 	auto drawList = ImGui::GetWindowDrawList();
-	float longest(mTextStart);
 
 	if (mScrollToTop)
 	{
 		mScrollToTop = false;
-		ImGui::SetScrollY(0.f);
+		SetScrollY(0.0);
 	}
 
 	ImVec2 cursorScreenPos = ImGui::GetCursorScreenPos();
 	auto scrollX = ImGui::GetScrollX();
-	auto scrollY = ImGui::GetScrollY();
+	const double scrollY = mScrollY;
 
 	auto lineNo = (int)floor(scrollY / mCharAdvance.y);
-	auto globalLineMax = (int)mLines.size();
-	auto lineMax = std::max(0, std::min((int)mLines.size() - 1, lineNo + (int)floor((scrollY + contentSize.y) / mCharAdvance.y)));
+	auto lineMax = std::max(0, std::min((int)mLines.size() - 1, (int)floor((scrollY + contentSize.y) / mCharAdvance.y)));
 
-	// Deduce mTextStart by evaluating mLines size (global lineMax) plus two spaces as text width
-	char buf[16];
-	snprintf(buf, 16, " %d ", globalLineMax);
-	mTextStart = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf, nullptr, nullptr).x + mLeftMargin;
+	UpdateGutter();
+	PruneLineCaches(lineMax - lineNo + 1);
+	UpdateLineWidths();
+
+	mRenderedFirstLine = lineNo;
+	mRenderedLastLine = lineMax;
+
+	const ImFont* font = ImGui::GetFont();
+	const float fontScale = ImGui::GetFontSize() / font->FontSize;
+	mBlinkDeadline = DBL_MAX;
+	bool cursorDrawn = false;
+	bool tooltipShown = false;
+
+	// Horizontal range of the text (relative to its start) that is inside the window
+	const float visibleMinX = scrollX - mTextStart;
+	const float visibleMaxX = visibleMinX + contentSize.x;
+
+	// First extra cursor that may be on the rendered lines
+	auto extraCursor = std::lower_bound(mExtraCursors.begin(), mExtraCursors.end(), lineNo,
+		[](const EditorState& aCursor, int aLine) { return aCursor.mSelectionEnd.mLine < aLine; });
 
 	if (!mLines.empty())
 	{
-		float spaceSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, " ", nullptr, nullptr).x;
-
 		while (lineNo <= lineMax)
 		{
-			ImVec2 lineStartScreenPos = ImVec2(cursorScreenPos.x, cursorScreenPos.y + lineNo * mCharAdvance.y);
+			ImVec2 lineStartScreenPos = ImVec2(cursorScreenPos.x, GetLineScreenY(lineNo));
 			ImVec2 textScreenPos = ImVec2(lineStartScreenPos.x + mTextStart, lineStartScreenPos.y);
 
 			auto& line = mLines[lineNo];
-			longest = std::max(mTextStart + TextDistanceToLineStart(Coordinates(lineNo, GetLineMaxColumn(lineNo))), longest);
-			auto columnNo = 0;
+			auto& layout = GetLineLayout(lineNo);
+			mLineWidths.SetWidth(lineNo, line.GetRevision(), layout.mOffsets.back());
 			Coordinates lineStartCoord(lineNo, 0);
-			Coordinates lineEndCoord(lineNo, GetLineMaxColumn(lineNo));
-
-			// Draw selection for the current line
-			float sstart = -1.0f;
-			float ssend = -1.0f;
+			Coordinates lineEndCoord(lineNo, layout.mMaxColumn);
 
-			assert(mState.mSelectionStart <= mState.mSelectionEnd);
-			if (mState.mSelectionStart <= lineEndCoord)
-			{
-				sstart = mState.mSelectionStart > lineStartCoord ? TextDistanceToLineStart(mState.mSelectionStart) : 0.0f;
-			}
-			if (mState.mSelectionEnd > lineStartCoord)
 			{
-				ssend = TextDistanceToLineStart(mState.mSelectionEnd < lineEndCoord ? mState.mSelectionEnd : lineEndCoord);
+				const ImVec2 vstart(lineStartScreenPos.x + mTextStart, lineStartScreenPos.y);
+				const ImVec2 vend(lineStartScreenPos.x + mTextStart + TextDistanceToLineStart(lineEndCoord), lineStartScreenPos.y + mCharAdvance.y);
+				const static ImU32 textBackgroundColor = 0xD0000000;
+				drawList->AddRectFilled(vstart, vend, mPalette[(int)PaletteIndex::Background]);
 			}
 
-			if (mState.mSelectionEnd.mLine > lineNo)
+			// Draw the selections on the current line
+			auto drawSelection = [&](const EditorState& aState)
 			{
-				ssend += mCharAdvance.x;
-			}
+				float sstart = -1.0f;
+				float ssend = -1.0f;
+
+				assert(aState.mSelectionStart <= aState.mSelectionEnd);
+				if (aState.mSelectionStart <= lineEndCoord)
+				{
+					sstart = aState.mSelectionStart > lineStartCoord ? TextDistanceToLineStart(aState.mSelectionStart) : 0.0f;
+				}
+				if (aState.mSelectionEnd > lineStartCoord)
+				{
+					ssend = TextDistanceToLineStart(aState.mSelectionEnd < lineEndCoord ? aState.mSelectionEnd : lineEndCoord);
+				}
+
+				if (aState.mSelectionEnd.mLine > lineNo)
+				{
+					ssend += mCharAdvance.x;
+				}
+
+				if (sstart != -1 && ssend != -1 && sstart < ssend)
+				{
+					ImVec2 vstart(lineStartScreenPos.x + mTextStart + sstart, lineStartScreenPos.y);
+					ImVec2 vend(lineStartScreenPos.x + mTextStart + ssend, lineStartScreenPos.y + mCharAdvance.y);
+					drawList->AddRectFilled(vstart, vend, mPalette[(int)PaletteIndex::Selection]);
+				}
+			};
 
+			drawSelection(mState);
+
+			// The extra cursors are sorted and do not overlap, so the ones on this line follow the ones on the lines above
+			while (extraCursor != mExtraCursors.end() && extraCursor->mSelectionEnd.mLine < lineNo)
 			{
-				const ImVec2 vstart(lineStartScreenPos.x + mTextStart, lineStartScreenPos.y);
-				const ImVec2 vend(lineStartScreenPos.x + mTextStart + TextDistanceToLineStart(lineEndCoord), lineStartScreenPos.y + mCharAdvance.y);
-				const static ImU32 textBackgroundColor = 0xD0000000;
-				drawList->AddRectFilled(vstart, vend, mPalette[(int)PaletteIndex::Background]);
+				++extraCursor;
 			}
 
-			if (sstart != -1 && ssend != -1 && sstart < ssend)
+			for (auto it = extraCursor; it != mExtraCursors.end() && it->mSelectionStart.mLine <= lineNo; ++it)
 			{
-				ImVec2 vstart(lineStartScreenPos.x + mTextStart + sstart, lineStartScreenPos.y);
-				ImVec2 vend(lineStartScreenPos.x + mTextStart + ssend, lineStartScreenPos.y + mCharAdvance.y);
-				drawList->AddRectFilled(vstart, vend, mPalette[(int)PaletteIndex::Selection]);
+				drawSelection(*it);
 			}
 
-			// Draw breakpoints
+			// Draw breakpoints, bookmarks and error markers
 			auto start = ImVec2(lineStartScreenPos.x + scrollX, lineStartScreenPos.y);
+			auto markers = GetLineMarkers(lineNo);
 
-			if (mBreakpoints.count(lineNo + 1) != 0)
+			if (markers != nullptr && markers->mBreakpoint)
 			{
 				auto end = ImVec2(lineStartScreenPos.x + contentSize.x + 2.0f * scrollX, lineStartScreenPos.y + mCharAdvance.y);
 				drawList->AddRectFilled(start, end, mPalette[(int)PaletteIndex::Breakpoint]);
 			}
 
-			// Draw error markers
-			auto errorIt = mErrorMarkers.find(lineNo + 1);
-			if (errorIt != mErrorMarkers.end())
+			if (markers != nullptr && markers->mBookmark)
+			{
+				auto bookmarkStart = ImVec2(start.x + 1.0f, start.y + 1.0f);
+				auto bookmarkEnd = ImVec2(start.x + std::max(2.0f, mLeftMargin * 0.5f), start.y + mCharAdvance.y - 1.0f);
+				drawList->AddRectFilled(bookmarkStart, bookmarkEnd, mPalette[(int)PaletteIndex::LineNumber]);
+			}
+
+			if (markers != nullptr && markers->mError)
 			{
 				auto end = ImVec2(lineStartScreenPos.x + contentSize.x + 2.0f * scrollX, lineStartScreenPos.y + mCharAdvance.y);
 				drawList->AddRectFilled(start, end, mPalette[(int)PaletteIndex::ErrorMarker]);
 
 				if (ImGui::IsMouseHoveringRect(lineStartScreenPos, end))
 				{
+					tooltipShown = true;
 					ImGui::BeginTooltip();
 					ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.2f, 0.2f, 1.0f));
-					ImGui::Text("Error at line %d:", errorIt->first);
+					ImGui::Text("Error at line %d:", lineNo + 1);
 					ImGui::PopStyleColor();
 					ImGui::Separator();
 					ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 1.0f, 0.2f, 1.0f));
-					ImGui::Text("%s", errorIt->second.c_str());
+					ImGui::Text("%s", markers->mErrorMessage.c_str());
 					ImGui::PopStyleColor();
 					ImGui::EndTooltip();
 				}
 			}
 
-			// Draw line number (right aligned)
-			snprintf(buf, 16, "%d  ", lineNo + 1);
+			auto focused = ImGui::IsWindowFocused();
 
-			auto lineNoWidth = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf, nullptr, nullptr).x;
-			drawList->AddText(ImVec2(lineStartScreenPos.x + mTextStart - lineNoWidth, lineStartScreenPos.y), mPalette[(int)PaletteIndex::LineNumber], buf);
-
-			if (mState.mCursorPosition.mLine == lineNo)
+			// Highlight the current line (where the cursor is)
+			if (mState.mCursorPosition.mLine == lineNo && !HasSelection())
 			{
-				auto focused = ImGui::IsWindowFocused();
+				auto end = ImVec2(start.x + contentSize.x + scrollX, start.y + mCharAdvance.y);
+				drawList->AddRectFilled(start, end, mPalette[(int)(focused ? PaletteIndex::CurrentLineFill : PaletteIndex::CurrentLineFillInactive)]);
+				drawList->AddRect(start, end, mPalette[(int)PaletteIndex::CurrentLineEdge], 1.0f);
+			}
 
-				// Highlight the current line (where the cursor is)
-				if (!HasSelection())
+			// Render the cursors
+			auto drawCursor = [&](const Coordinates& aPosition)
+			{
+				// The cursor is hidden during the first half of every 800 ms blink cycle
+				const double time = ImGui::GetTime();
+				const double phase = fmod(time - mStartTime, 0.8);
+				mBlinkDeadline = time + (phase > 0.4 ? 0.8 - phase : 0.4 - phase);
+				if (phase > 0.4)
 				{
-					auto end = ImVec2(start.x + contentSize.x + scrollX, start.y + mCharAdvance.y);
-					drawList->AddRectFilled(start, end, mPalette[(int)(focused ? PaletteIndex::CurrentLineFill : PaletteIndex::CurrentLineFillInactive)]);
-					drawList->AddRect(start, end, mPalette[(int)PaletteIndex::CurrentLineEdge], 1.0f);
-				}
+					cursorDrawn = true;
+					float width = 1.0f;
+					auto cindex = GetCharacterIndex(aPosition);
+					float cx = TextDistanceToLineStart(aPosition);
 
-				// Render the cursor
-				if (focused)
-				{
-					auto timeEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-					auto elapsed = timeEnd - mStartTime;
-					if (elapsed > 400)
+					if (mOverwrite && cindex < (int)line.size())
 					{
-						float width = 1.0f;
-						auto cindex = GetCharacterIndex(mState.mCursorPosition);
-						float cx = TextDistanceToLineStart(mState.mCursorPosition);
-
-						if (mOverwrite && cindex < (int)line.size())
+						auto c = line[cindex].mChar;
+						if (c == '\t')
 						{
-							auto c = line[cindex].mChar;
-							if (c == '\t')
-							{
-								auto x = (1.0f + std::floor((1.0f + cx) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-								width = x - cx;
-							}
-							else
-							{
-								char buf2[2];
-								buf2[0] = line[cindex].mChar;
-								buf2[1] = '\0';
-								width = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf2).x;
-							}
+							width = mGlyphAdvances->GetNextTabStop(cx, mTabSize) - cx;
 						}
-
-						ImVec2 cstart(textScreenPos.x + cx, lineStartScreenPos.y);
-						ImVec2 cend(textScreenPos.x + cx + width, lineStartScreenPos.y + mCharAdvance.y);
-						drawList->AddRectFilled(cstart, cend, mPalette[(int)PaletteIndex::Cursor]);
-						if (elapsed > 800)
+						else
 						{
-							mStartTime = timeEnd;
+							auto d = std::min(UTF8CharLength(c), (int)line.size() - cindex);
+							width = mFixedPitch && d == 1 ? mCharAdvance.x : mGlyphAdvances->GetAdvance(&line[cindex], d);
 						}
 					}
-				}
-			}
 
-			// Render colorized text
-			auto prevColor = line.empty() ? mPalette[(int)PaletteIndex::Default] : GetGlyphColor(line[0]);
-			ImVec2 bufferOffset;
+					ImVec2 cstart(textScreenPos.x + cx, lineStartScreenPos.y);
+					ImVec2 cend(textScreenPos.x + cx + width, lineStartScreenPos.y + mCharAdvance.y);
+					drawList->AddRectFilled(cstart, cend, mPalette[(int)PaletteIndex::Cursor]);
+				}
+			};
 
-			for (int i = 0; i < line.size();)
+			if (focused)
 			{
-				auto& glyph = line[i];
-				auto color = GetGlyphColor(glyph);
-
-				if ((color != prevColor || glyph.mChar == '\t' || glyph.mChar == ' ') && !mLineBuffer.empty())
+				if (mState.mCursorPosition.mLine == lineNo)
 				{
-					const ImVec2 newOffset(textScreenPos.x + bufferOffset.x, textScreenPos.y + bufferOffset.y);
-					drawList->AddText(newOffset, prevColor, mLineBuffer.c_str());
-					auto textSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, mLineBuffer.c_str(), nullptr, nullptr);
-					bufferOffset.x += textSize.x;
-					mLineBuffer.clear();
+					drawCursor(mState.mCursorPosition);
 				}
 
-				prevColor = color;
-
-				if (glyph.mChar == '\t')
+				for (auto it = extraCursor; it != mExtraCursors.end() && it->mSelectionStart.mLine <= lineNo; ++it)
 				{
-					auto oldX = bufferOffset.x;
-					bufferOffset.x = (1.0f + std::floor((1.0f + bufferOffset.x) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-					++i;
-
-					if (mShowWhitespaces)
+					if (it->mCursorPosition.mLine == lineNo)
 					{
-						const auto s = ImGui::GetFontSize();
-						const auto x1 = textScreenPos.x + oldX + 1.0f;
-						const auto x2 = textScreenPos.x + bufferOffset.x - 1.0f;
-						const auto y = textScreenPos.y + bufferOffset.y + s * 0.5f;
-						const ImVec2 p1(x1, y);
-						const ImVec2 p2(x2, y);
-						const ImVec2 p3(x2 - s * 0.2f, y - s * 0.2f);
-						const ImVec2 p4(x2 - s * 0.2f, y + s * 0.2f);
-						drawList->AddLine(p1, p2, 0x90909090);
-						drawList->AddLine(p2, p3, 0x90909090);
-						drawList->AddLine(p2, p4, 0x90909090);
+						drawCursor(it->mCursorPosition);
 					}
 				}
-				else if (glyph.mChar == ' ')
+			}
+
+			// Render colorized text, skipping straight to the part inside the horizontal clip range, with the glyph
+			// placement of ImFont::RenderText. The search starts a few glyphs early for glyphs overhanging their pen position.
+			auto& drawing = GetLineDrawing(lineNo);
+			auto firstQuad = std::lower_bound(drawing.mQuads.begin(), drawing.mQuads.end(), visibleMinX - 4.0f * mCharAdvance.x,
+				[](const LineDrawing::Quad& aQuad, float aX) { return aQuad.mX < aX; });
+			auto lastQuad = firstQuad;
+			while (lastQuad != drawing.mQuads.end() && lastQuad->mX <= visibleMaxX)
+			{
+				++lastQuad;
+			}
+
+			if (firstQuad != lastQuad)
+			{
+				const ImVec2 origin(floorf(textScreenPos.x), floorf(textScreenPos.y));
+				const int count = (int)(lastQuad - firstQuad);
+				drawList->PrimReserve(count * 6, count * 4);
+				for (auto quad = firstQuad; quad != lastQuad; ++quad)
+				{
+					auto fontGlyph = font->FindGlyph(quad->mCodepoint);
+					const float x = origin.x + quad->mX;
+					drawList->PrimRectUV(ImVec2(x + fontGlyph->X0 * fontScale, origin.y + fontGlyph->Y0 * fontScale),
+						ImVec2(x + fontGlyph->X1 * fontScale, origin.y + fontGlyph->Y1 * fontScale),
+						ImVec2(fontGlyph->U0, fontGlyph->V0), ImVec2(fontGlyph->U1, fontGlyph->V1), quad->mColor);
+				}
+			}
+
+			if (mShowWhitespaces)
+			{
+				auto firstWhitespace = std::lower_bound(drawing.mWhitespaces.begin(), drawing.mWhitespaces.end(), visibleMinX,
+					[](const LineDrawing::Whitespace& aWhitespace, float aX) { return aWhitespace.mX2 < aX; });
+				auto lastWhitespace = firstWhitespace;
+				int count = 0;
+				while (lastWhitespace != drawing.mWhitespaces.end() && lastWhitespace->mX1 <= visibleMaxX)
 				{
-					if (mShowWhitespaces)
-					{
-						const auto s = ImGui::GetFontSize();
-						const auto x = textScreenPos.x + bufferOffset.x + spaceSize * 0.5f;
-						const auto y = textScreenPos.y + bufferOffset.y + s * 0.5f;
-						drawList->AddCircleFilled(ImVec2(x, y), 1.5f, 0x80808080, 4);
-					}
-					bufferOffset.x += spaceSize;
-					i++;
+					count += lastWhitespace->mTab ? 3 : 1;
+					++lastWhitespace;
 				}
-				else
+
+				if (count > 0)
 				{
-					auto l = UTF8CharLength(glyph.mChar);
-					while (l-- > 0)
+					// Tabs are an arrow made of three one pixel wide segments, spaces a small diamond
+					const auto s = ImGui::GetFontSize();
+					const auto y = textScreenPos.y + s * 0.5f;
+					const auto uv = ImGui::GetFontTexUvWhitePixel();
+					auto addSegment = [&](const ImVec2& aFrom, const ImVec2& aTo, ImU32 aColor)
+					{
+						const float dx = aTo.x - aFrom.x;
+						const float dy = aTo.y - aFrom.y;
+						const float scale = 0.5f / std::max(sqrtf(dx * dx + dy * dy), 0.001f);
+						const ImVec2 n(-dy * scale, dx * scale);
+						drawList->PrimQuadUV(ImVec2(aFrom.x + n.x, aFrom.y + n.y), ImVec2(aTo.x + n.x, aTo.y + n.y),
+							ImVec2(aTo.x - n.x, aTo.y - n.y), ImVec2(aFrom.x - n.x, aFrom.y - n.y), uv, uv, uv, uv, aColor);
+					};
+
+					drawList->PrimReserve(count * 6, count * 4);
+					for (auto it = firstWhitespace; it != lastWhitespace; ++it)
 					{
-						mLineBuffer.push_back(line[i++].mChar);
+						auto& whitespace = *it;
+						if (whitespace.mTab)
+						{
+							const auto x1 = textScreenPos.x + whitespace.mX1 + 1.0f;
+							const auto x2 = textScreenPos.x + whitespace.mX2 - 1.0f;
+							const ImVec2 p1(x1, y);
+							const ImVec2 p2(x2, y);
+							const ImVec2 p3(x2 - s * 0.2f, y - s * 0.2f);
+							const ImVec2 p4(x2 - s * 0.2f, y + s * 0.2f);
+							addSegment(p1, p2, 0x90909090);
+							addSegment(p2, p3, 0x90909090);
+							addSegment(p2, p4, 0x90909090);
+						}
+						else
+						{
+							const auto x = textScreenPos.x + (whitespace.mX1 + whitespace.mX2) * 0.5f;
+							drawList->PrimQuadUV(ImVec2(x - 1.5f, y), ImVec2(x, y - 1.5f), ImVec2(x + 1.5f, y), ImVec2(x, y + 1.5f),
+								uv, uv, uv, uv, 0x80808080);
+						}
 					}
 				}
-
-				++columnNo;
-			}
-
-			if (!mLineBuffer.empty())
-			{
-				const ImVec2 newOffset(textScreenPos.x + bufferOffset.x, textScreenPos.y + bufferOffset.y);
-				drawList->AddText(newOffset, prevColor, mLineBuffer.c_str());
-				mLineBuffer.clear();
 			}
 
 			++lineNo;
 		}
 
-		// Draw a tooltip on known identifiers/preprocessor symbols
+		if (!mDiagnostics.IsEmpty())
+		{
+			RenderDiagnostics(drawList, cursorScreenPos.x + mTextStart, mRenderedFirstLine, lineMax, visibleMinX, visibleMaxX);
+		}
+
+		RenderGutter(drawList, cursorScreenPos.x, mRenderedFirstLine, lineMax);
+
 		if (ImGui::IsMousePosValid())
 		{
-			auto id = GetWordAt(ScreenPosToCoordinates(ImGui::GetMousePos()));
+			auto mouseCoords = ScreenPosToCoordinates(ImGui::GetMousePos());
+
+			// Draw a tooltip on diagnostics
+			if (!mDiagnostics.IsEmpty() && ImGui::IsWindowHovered())
+			{
+				if (auto diagnostic = GetDiagnosticAt(mouseCoords))
+				{
+					static const char* const severityNames[] = { "Error", "Warning", "Info" };
+					tooltipShown = true;
+					ImGui::BeginTooltip();
+					ImGui::PushStyleColor(ImGuiCol_Text, ImGui::ColorConvertU32ToFloat4(mPalette[(int)PaletteIndex::DiagnosticError + (int)diagnostic->mSeverity]));
+					ImGui::Text("%s at line %d:", severityNames[(int)diagnostic->mSeverity], diagnostic->mStart.mLine + 1);
+					ImGui::PopStyleColor();
+					ImGui::Separator();
+					ImGui::TextUnformatted(diagnostic->mMessage.c_str());
+					ImGui::EndTooltip();
+				}
+			}
+
+			// Draw a tooltip on known identifiers/preprocessor symbols
+			auto& id = mHoveredWord;
+			GetWordAt(mouseCoords, id);
 			if (!id.empty())
 			{
 				auto it = mLanguageDefinition.mIdentifiers.find(id);
 				if (it != mLanguageDefinition.mIdentifiers.end())
 				{
+					tooltipShown = true;
 					ImGui::BeginTooltip();
 					ImGui::TextUnformatted(it->second.mDeclaration.c_str());
 					ImGui::EndTooltip();
@@ -1332,6 +3599,7 @@ void TextEditor::Render()
 					auto pi = mLanguageDefinition.mPreprocIdentifiers.find(id);
 					if (pi != mLanguageDefinition.mPreprocIdentifiers.end())
 					{
+						tooltipShown = true;
 						ImGui::BeginTooltip();
 						ImGui::TextUnformatted(pi->second.mDeclaration.c_str());
 						ImGui::EndTooltip();
@@ -1341,20 +3609,57 @@ void TextEditor::Render()
 		}
 	}
 
+	// Progress of a large insert, in the top right corner of the window
+	if (IsInserting())
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "Inserting... %d%%", (int)(GetInsertProgress() * 100.0f));
+		const ImVec2 textSize = ImGui::CalcTextSize(buf);
+		const ImVec2 windowPos = ImGui::GetWindowPos();
+		const ImVec2 textPos(windowPos.x + contentSize.x - textSize.x - mCharAdvance.x, windowPos.y + mCharAdvance.y * 0.5f);
+		drawList->AddRectFilled(ImVec2(textPos.x - mCharAdvance.x * 0.5f, textPos.y),
+			ImVec2(textPos.x + textSize.x + mCharAdvance.x * 0.5f, textPos.y + textSize.y), mPalette[(int)PaletteIndex::Background]);
+		drawList->AddText(textPos, mPalette[(int)PaletteIndex::Default], buf);
+	}
 
-	ImGui::Dummy(ImVec2((longest + 2), mLines.size() * mCharAdvance.y));
+	// The content width covers the widest line of the whole document, not just of the visible lines
+	const float longest = mTextStart + mLineWidths.GetMaxWidth();
+	ImGui::Dummy(ImVec2((longest + 2), mScrollHeight));
 
 	if (mScrollToCursor)
 	{
 		EnsureCursorVisible();
 		ImGui::SetWindowFocus();
 		mScrollToCursor = false;
+		mScrollRequested = true;
+	}
+
+	// Everything else that affects what was drawn comes from ImGui; tooltips follow the mouse
+	mRenderedStateSignature = GetStateSignature();
+	uint64_t frame = HashCombine(mRenderedStateSignature, mPaletteRevision);
+	frame = HashCombine(frame, (uint64_t)(uintptr_t)ImGui::GetFont());
+	frame = HashCombine(frame, HashFloat(ImGui::GetFontSize()));
+	frame = HashCombine(frame, HashFloat(cursorScreenPos.x));
+	frame = HashCombine(frame, HashFloat(cursorScreenPos.y));
+	frame = HashCombine(frame, HashDouble(scrollY));
+	frame = HashCombine(frame, HashFloat(contentSize.x));
+	frame = HashCombine(frame, HashFloat(contentSize.y));
+	frame = HashCombine(frame, (uint64_t)ImGui::IsWindowFocused() | (uint64_t)cursorDrawn << 1 | (uint64_t)tooltipShown << 2);
+	if (tooltipShown)
+	{
+		frame = HashCombine(frame, HashFloat(ImGui::GetMousePos().x));
+		frame = HashCombine(frame, HashFloat(ImGui::GetMousePos().y));
 	}
+
+	mFrameUnchanged = frame == mFrameSignature;
+	mFrameSignature = frame;
 }
 
 void TextEditor::Render(const char* aTitle, const ImVec2& aSize, bool aBorder)
 {
 	mWithinRender = true;
+	mScrollRequested = false;
+	UpdateDiagnosticsProvider();
 	mTextChanged = false;
 	mCursorPositionChanged = false;
 
@@ -1365,6 +3670,29 @@ void TextEditor::Render(const char* aTitle, const ImVec2& aSize, bool aBorder)
 		ImGui::BeginChild(aTitle, aSize, aBorder, ImGuiWindowFlags_HorizontalScrollbar | ImGuiWindowFlags_AlwaysHorizontalScrollbar | ImGuiWindowFlags_NoMove);
 	}
 
+	// Looked up every frame, so that a font or scale change picks another cache
+	auto advances = GlyphAdvanceCache::Get(ImGui::GetFont(), ImGui::GetFontSize());
+	if (advances.get() != mGlyphAdvances)
+	{
+		// Caches are told apart by address, which a freed cache may pass on to a later one,
+		// so nothing measured with the previous one is kept
+		mLineLayouts.clear();
+		mLineDrawings.clear();
+		mGutter.mAdvances = nullptr;
+		mLineWidthsAdvances = nullptr;
+		mGlyphAdvancesOwner = std::move(advances);
+		mGlyphAdvances = mGlyphAdvancesOwner.get();
+	}
+
+	mFixedPitch = mFontPitch == FontPitch::Auto ? mGlyphAdvances->IsFixedPitch() : mFontPitch == FontPitch::Fixed;
+
+	// Compute mCharAdvance regarding to scaled font size (Ctrl + mouse wheel)
+	const Glyph sharp('#', PaletteIndex::Default);
+	const float fontSize = mGlyphAdvances->GetAdvance(&sharp, 1);
+	mCharAdvance = ImVec2(fontSize, ImGui::GetTextLineHeightWithSpacing() * mLineSpacing);
+
+	UpdateScroll();
+
 	if (mHandleKeyboardInputs)
 	{
 		HandleKeyboardInputs();
@@ -1376,6 +3704,8 @@ void TextEditor::Render(const char* aTitle, const ImVec2& aSize, bool aBorder)
 		HandleMouseInputs();
 	}
 
+	// A large insert goes in a chunk per frame
+	ContinueInsert(mInsertChunkSize);
 	ColorizeInternal();
 	Render();
 
@@ -1395,8 +3725,79 @@ void TextEditor::Render(const char* aTitle, const ImVec2& aSize, bool aBorder)
 	mWithinRender = false;
 }
 
+uint64_t TextEditor::GetStateSignature() const
+{
+	// Visible lines are renewed by any edit or colorization, so their revisions stand for their content
+	uint64_t signature = HashCombine(0, mLines.size());
+	const int lastLine = std::min(mRenderedLastLine, (int)mLines.size() - 1);
+	for (int i = mRenderedFirstLine; i <= lastLine; ++i)
+	{
+		signature = HashCombine(signature, mLines[i].GetRevision());
+	}
+
+	for (auto& coord : { mState.mCursorPosition, mState.mSelectionStart, mState.mSelectionEnd })
+	{
+		signature = HashCombine(signature, (uint64_t)(uint32_t)coord.mLine << 32 | (uint32_t)coord.mColumn);
+	}
+
+	signature = HashCombine(signature, mExtraCursors.size());
+	for (auto& cursor : mExtraCursors)
+	{
+		for (auto& coord : { cursor.mCursorPosition, cursor.mSelectionStart, cursor.mSelectionEnd })
+		{
+			signature = HashCombine(signature, (uint64_t)(uint32_t)coord.mLine << 32 | (uint32_t)coord.mColumn);
+		}
+	}
+
+	for (auto color : mPaletteBase)
+	{
+		signature = HashCombine(signature, color);
+	}
+
+	signature = HashCombine(signature, (uint64_t)mShowWhitespaces | (uint64_t)mOverwrite << 1 | (uint64_t)mColorizerEnabled << 2);
+	signature = HashCombine(signature, (uint64_t)mTabSize << 32 | (uint32_t)mLineLengthLimit);
+	signature = HashCombine(signature, (uint64_t)mFontPitch);
+	signature = HashCombine(signature, HashFloat(mLineSpacing));
+
+	// Markers and diagnostics move with their lines, so only their own changes need to be accounted for
+	signature = HashCombine(signature, mMarkersRevision);
+	return HashCombine(signature, mDiagnostics.GetRevision());
+}
+
+bool TextEditor::IsRedrawNeeded() const
+{
+	const bool colorizing = mColorizerEnabled && (mCheckComments || mColorRangeMin < mColorRangeMax);
+	return colorizing || (IsInserting() && !mReadOnly) || mScrollToTop || mScrollToCursor || mScrollRequested || mLineWidths.HasDirtyLines() ||
+		GetStateSignature() != mRenderedStateSignature;
+}
+
+double TextEditor::GetNextRedrawTime() const
+{
+	const double time = ImGui::GetTime();
+	if (IsRedrawNeeded())
+	{
+		return time;
+	}
+
+	// A snapshot is due for the diagnostics provider, or its result is polled for while it runs
+	const double diagnosticsTime = mDiagnosticsRunning ? time + 0.1 : mDiagnosticsDueTime;
+	return std::min(mBlinkDeadline, diagnosticsTime);
+}
+
 void TextEditor::SetText(const std::string & aText)
 {
+	ReplaceText(aText);
+	mScrollToTop = true;
+
+	mExtraCursors.clear();
+	CancelInsert();
+	ClearUndo();
+}
+
+void TextEditor::ReplaceText(const std::string & aText)
+{
+	// The markers stay on their line numbers, and the diagnostics too
+	DetachMarkers();
 	mLines.clear();
 	mLines.emplace_back(Line());
 	for (auto chr : aText)
@@ -1416,16 +3817,15 @@ void TextEditor::SetText(const std::string & aText)
 	}
 
 	mTextChanged = true;
-	mScrollToTop = true;
-
-	mUndoBuffer.clear();
-	mUndoIndex = 0;
-
+	++mTextRevision;
+	mLineWidths.Reset((int)mLines.size());
+	AttachMarkers();
 	Colorize();
 }
 
 void TextEditor::SetTextLines(const std::vector<std::string> & aLines)
 {
+	DetachMarkers();
 	mLines.clear();
 
 	if (aLines.empty())
@@ -1449,11 +3849,15 @@ void TextEditor::SetTextLines(const std::vector<std::string> & aLines)
 	}
 
 	mTextChanged = true;
+	++mTextRevision;
 	mScrollToTop = true;
 
-	mUndoBuffer.clear();
-	mUndoIndex = 0;
+	mExtraCursors.clear();
+	CancelInsert();
+	ClearUndo();
 
+	mLineWidths.Reset((int)mLines.size());
+	AttachMarkers();
 	Colorize();
 }
 
@@ -1461,6 +3865,12 @@ void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
 {
 	assert(!mReadOnly);
 
+	if (!mExtraCursors.empty())
+	{
+		EditCursors([=]() { EnterCharacter(aChar, aShift); });
+		return;
+	}
+
 	UndoRecord u;
 
 	u.mBefore = mState;
@@ -1469,89 +3879,13 @@ void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
 	{
 		if (aChar == '\t' && mState.mSelectionStart.mLine != mState.mSelectionEnd.mLine)
 		{
-			auto start = mState.mSelectionStart;
-			auto end = mState.mSelectionEnd;
-			auto originalEnd = end;
-
-			if (start > end)
-				std::swap(start, end);
-			start.mColumn = 0;
-
-			if (end.mColumn == 0 && end.mLine > 0)
-			{
-				--end.mLine;
-			}
-
-			if (end.mLine >= (int)mLines.size())
-			{
-				end.mLine = mLines.empty() ? 0 : (int)mLines.size() - 1;
-			}
-
-			end.mColumn = GetLineMaxColumn(end.mLine);
-
-			u.mRemovedStart = start;
-			u.mRemovedEnd = end;
-			u.mRemoved = GetText(start, end);
-
-			bool modified = false;
-
-			for (int i = start.mLine; i <= end.mLine; i++)
+			if (aShift)
 			{
-				auto& line = mLines[i];
-				if (aShift)
-				{
-					if (!line.empty())
-					{
-						if (line.front().mChar == '\t')
-						{
-							line.erase(line.begin());
-							modified = true;
-						}
-						else
-						{
-							for (int j = 0; j < mTabSize && !line.empty() && line.front().mChar == ' '; j++)
-							{
-								line.erase(line.begin());
-								modified = true;
-							}
-						}
-					}
-				}
-				else
-				{
-					line.insert(line.begin(), Glyph('\t', TextEditor::PaletteIndex::Background));
-					modified = true;
-				}
+				UnindentLines();
 			}
-
-			if (modified)
+			else
 			{
-				start = Coordinates(start.mLine, GetCharacterColumn(start.mLine, 0));
-				Coordinates rangeEnd;
-				if (originalEnd.mColumn != 0)
-				{
-					end = Coordinates(end.mLine, GetLineMaxColumn(end.mLine));
-					rangeEnd = end;
-					u.mAdded = GetText(start, end);
-				}
-				else
-				{
-					end = Coordinates(originalEnd.mLine, 0);
-					rangeEnd = Coordinates(end.mLine - 1, GetLineMaxColumn(end.mLine - 1));
-					u.mAdded = GetText(start, rangeEnd);
-				}
-
-				u.mAddedStart = start;
-				u.mAddedEnd = rangeEnd;
-				u.mAfter = mState;
-
-				mState.mSelectionStart = start;
-				mState.mSelectionEnd = end;
-				AddUndo(u);
-
-				mTextChanged = true;
-
-				EnsureCursorVisible();
+				IndentLines();
 			}
 
 			return;
@@ -1567,6 +3901,7 @@ void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
 
 	auto coord = GetActualCursorCoordinates();
 	u.mAddedStart = coord;
+	u.mKind = UndoKind::Typing;
 
 	assert(!mLines.empty());
 
@@ -1588,8 +3923,17 @@ void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
 		auto cindex = GetCharacterIndex(coord);
 		newLine.insert(newLine.end(), line.begin() + cindex, line.end());
 		line.erase(line.begin() + cindex, line.begin() + line.size());
+		newLine.Touch();
+		line.Touch();
+		mLineWidths.MarkDirty(coord.mLine);
 		SetCursorPosition(Coordinates(coord.mLine + 1, GetCharacterColumn(coord.mLine + 1, (int)whitespaceSize)));
+
+		// The indentation is part of the added text, so that Redo() puts it back too
 		u.mAdded = (char)aChar;
+		for (size_t it = 0; it < whitespaceSize; ++it)
+		{
+			u.mAdded += (char)newLine[it].mChar;
+		}
 	}
 	else
 	{
@@ -1601,36 +3945,126 @@ void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
 			auto& line = mLines[coord.mLine];
 			auto cindex = GetCharacterIndex(coord);
 
-			if (mOverwrite && cindex < (int)line.size())
-			{
-				auto d = UTF8CharLength(line[cindex].mChar);
+			if (mOverwrite && cindex < (int)line.size())
+			{
+				auto d = UTF8CharLength(line[cindex].mChar);
+
+				u.mRemovedStart = mState.mCursorPosition;
+				u.mRemovedEnd = Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex + d));
+
+				while (d-- > 0 && cindex < (int)line.size())
+				{
+					u.mRemoved += line[cindex].mChar;
+					line.erase(line.begin() + cindex);
+				}
+			}
+
+			for (auto p = buf; *p != '\0'; p++, ++cindex)
+			{
+				line.insert(line.begin() + cindex, Glyph(*p, PaletteIndex::Default));
+			}
+
+			line.Touch();
+			mLineWidths.MarkDirty(coord.mLine);
+
+			u.mAdded = buf;
+
+			SetCursorPosition(Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex)));
+		}
+		else
+		{
+			return;
+		}
+	}
+
+	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(coord.mLine, aChar == '\n' ? coord.mLine + 2 : coord.mLine + 1);
+
+	u.mAddedEnd = GetActualCursorCoordinates();
+	u.mAfter = mState;
+
+	AddUndo(u);
+
+	Colorize(coord.mLine - 1, 3);
+	EnsureCursorVisible();
+}
+
+void TextEditor::EnterText(const std::string& aText)
+{
+	assert(!mReadOnly);
+
+	if (aText.empty())
+	{
+		return;
+	}
+
+	if (!mExtraCursors.empty())
+	{
+		EditCursors([&]() { EnterText(aText); });
+		return;
+	}
 
-				u.mRemovedStart = mState.mCursorPosition;
-				u.mRemovedEnd = Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex + d));
+	// Same as EnterCharacter() for each character of aText, without line breaks, but with a single line edit
+	UndoRecord u;
+	u.mBefore = mState;
 
-				while (d-- > 0 && cindex < (int)line.size())
-				{
-					u.mRemoved += line[cindex].mChar;
-					line.erase(line.begin() + cindex);
-				}
-			}
+	if (HasSelection())
+	{
+		u.mRemoved = GetSelectedText();
+		u.mRemovedStart = mState.mSelectionStart;
+		u.mRemovedEnd = mState.mSelectionEnd;
+		DeleteSelection();
+	}
 
-			for (auto p = buf; *p != '\0'; p++, ++cindex)
+	auto coord = GetActualCursorCoordinates();
+	u.mAddedStart = coord;
+	u.mKind = UndoKind::Typing;
+
+	auto& line = mLines[coord.mLine];
+	auto cindex = GetCharacterIndex(coord);
+
+	if (mOverwrite && cindex < (int)line.size())
+	{
+		// As many characters as are typed are overwritten, following the selection if one was deleted
+		int end = cindex;
+		for (auto p = aText.begin(); p != aText.end() && end < (int)line.size(); ++p)
+		{
+			if (((uint8_t)*p & 0xC0) != 0x80)
 			{
-				line.insert(line.begin() + cindex, Glyph(*p, PaletteIndex::Default));
+				end = std::min((int)line.size(), end + UTF8CharLength(line[end].mChar));
 			}
+		}
 
-			u.mAdded = buf;
-
-			SetCursorPosition(Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex)));
+		if (u.mRemoved.empty())
+		{
+			u.mRemovedStart = coord;
 		}
-		else
+
+		for (int i = cindex; i < end; ++i)
 		{
-			return;
+			u.mRemoved += line[i].mChar;
 		}
+
+		u.mRemovedEnd = GetTextEnd(u.mRemovedStart, u.mRemoved);
+
+		line.erase(line.begin() + cindex, line.begin() + end);
+	}
+
+	line.insert(line.begin() + cindex, aText.size(), Glyph(' ', PaletteIndex::Default));
+	for (size_t i = 0; i < aText.size(); ++i)
+	{
+		line[cindex + i].mChar = aText[i];
 	}
 
+	line.Touch();
+	mLineWidths.MarkDirty(coord.mLine);
 	mTextChanged = true;
+	++mTextRevision;
+	InvalidateFindMatches(coord.mLine, coord.mLine + 1);
+
+	u.mAdded = aText;
+	SetCursorPosition(Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex + (int)aText.size())));
 
 	u.mAddedEnd = GetActualCursorCoordinates();
 	u.mAfter = mState;
@@ -1649,6 +4083,7 @@ void TextEditor::SetReadOnly(bool aValue)
 void TextEditor::SetColorizerEnable(bool aValue)
 {
 	mColorizerEnabled = aValue;
+	++mPaletteRevision; // Glyph colors depend on whether the colorizer is enabled
 }
 
 void TextEditor::SetCursorPosition(const Coordinates & aPosition)
@@ -1725,6 +4160,11 @@ void TextEditor::SetTabSize(int aValue)
 	mTabSize = std::max(0, std::min(32, aValue));
 }
 
+void TextEditor::SetLineLengthLimit(int aValue)
+{
+	mLineLengthLimit = std::max(0, aValue);
+}
+
 void TextEditor::InsertText(const std::string & aValue)
 {
 	InsertText(aValue.c_str());
@@ -1732,12 +4172,49 @@ void TextEditor::InsertText(const std::string & aValue)
 
 void TextEditor::InsertText(const char * aValue)
 {
-	if (aValue == nullptr)
+	if (aValue == nullptr || mReadOnly)
+	{
+		return;
+	}
+
+	FinishInsert();
+	UndoRecord u;
+	u.mBefore = mState;
+	u.mAddedStart = GetActualCursorCoordinates();
+
+	InsertTextInternal(aValue);
+
+	if (IsInserting())
 	{
+		// Completed and added once all of the text is in, see ContinueInsert()
+		mInsertRecord = std::move(u);
+		mInsertUndo = true;
 		return;
 	}
 
+	u.mAdded = aValue;
+	u.mAddedEnd = GetActualCursorCoordinates();
+	u.mAfter = mState;
+	AddUndo(u);
+}
+
+void TextEditor::InsertTextInternal(const char * aValue)
+{
+	// Text still going in from an earlier call comes first
+	FinishInsert();
+
 	auto pos = GetActualCursorCoordinates();
+
+	// Edits at several cursors and grouped edits are made at once, since their undo record is completed right after
+	if (mInsertChunkSize > 0 && mExtraCursors.empty() && mUndoBatch == nullptr && strlen(aValue) > mInsertChunkSize)
+	{
+		mInsertText = aValue;
+		mInsertOffset = 0;
+		mInsertWhere = pos;
+		ContinueInsert(mInsertChunkSize);
+		return;
+	}
+
 	auto start = std::min(pos, mState.mSelectionStart);
 	int totalLines = pos.mLine - start.mLine;
 
@@ -1748,6 +4225,242 @@ void TextEditor::InsertText(const char * aValue)
 	Colorize(start.mLine - 1, totalLines + 2);
 }
 
+float TextEditor::GetInsertProgress() const
+{
+	return IsInserting() ? (float)((double)mInsertOffset / (double)mInsertText.size()) : 1.0f;
+}
+
+void TextEditor::FinishInsert()
+{
+	ContinueInsert(0);
+}
+
+void TextEditor::ContinueInsert(size_t aBytes)
+{
+	// Left as it is while the editor is made read-only
+	if (!IsInserting() || mReadOnly)
+	{
+		return;
+	}
+
+	// A chunk ends after its last line break, or else before a UTF-8 continuation byte, so no character is split
+	size_t end = mInsertText.size();
+	if (aBytes > 0 && aBytes < end - mInsertOffset)
+	{
+		end = mInsertOffset + aBytes;
+		size_t lineEnd = end;
+		while (lineEnd > mInsertOffset && mInsertText[lineEnd - 1] != '\n')
+		{
+			--lineEnd;
+		}
+
+		if (lineEnd > mInsertOffset)
+		{
+			end = lineEnd;
+		}
+		else
+		{
+			while (end > mInsertOffset + 1 && ((uint8_t)mInsertText[end] & 0xC0) == 0x80)
+			{
+				--end;
+			}
+		}
+	}
+
+	const std::string chunk(mInsertText, mInsertOffset, end - mInsertOffset);
+	const int fromLine = mInsertWhere.mLine;
+	const int lines = InsertTextAt(mInsertWhere, chunk.c_str());
+	Colorize(fromLine - 1, lines + 2);
+	mInsertOffset = end;
+
+	if (mInsertOffset < mInsertText.size())
+	{
+		return;
+	}
+
+	SetSelection(mInsertWhere, mInsertWhere);
+	SetCursorPosition(mInsertWhere);
+
+	if (mInsertUndo)
+	{
+		mInsertRecord.mAdded = std::move(mInsertText);
+		mInsertRecord.mAddedEnd = mInsertWhere;
+		mInsertRecord.mAfter = mState;
+		AddUndo(mInsertRecord);
+	}
+
+	CancelInsert();
+}
+
+void TextEditor::CancelInsert()
+{
+	mInsertText.clear();
+	mInsertText.shrink_to_fit();
+	mInsertOffset = 0;
+	mInsertRecord = UndoRecord();
+	mInsertUndo = false;
+}
+
+void TextEditor::ApplyEdits(const TextEdits& aEdits)
+{
+	if (IsReadOnly() || aEdits.empty() || mLines.empty())
+	{
+		return;
+	}
+
+	// Positions are kept as lines and byte indices while the edits are made, columns may change along the line
+	typedef std::pair<int, int> Position;
+	auto toPosition = [this](const Coordinates& aValue)
+	{
+		auto pos = SanitizeCoordinates(aValue);
+		return Position(pos.mLine, GetCharacterIndex(pos));
+	};
+	auto toCoordinates = [this](const Position& aPosition)
+	{
+		const int line = std::min(aPosition.first, (int)mLines.size() - 1);
+		const int index = std::min(aPosition.second, (int)mLines[line].size());
+		return Coordinates(line, GetCharacterColumn(line, index));
+	};
+
+	std::vector<std::pair<Position, Position>> ranges(aEdits.size());
+	std::vector<int> order(aEdits.size());
+	for (size_t i = 0; i < aEdits.size(); ++i)
+	{
+		auto start = toPosition(aEdits[i].mStart);
+		auto end = toPosition(aEdits[i].mEnd);
+		ranges[i] = std::make_pair(std::min(start, end), std::max(start, end));
+		order[i] = (int)i;
+	}
+
+	// The edits are made from the bottom up, so the positions of the ones left stay valid. Insertions at the same
+	// place are made last to first, which leaves them in the order given, and before a range starting there.
+	std::stable_sort(order.begin(), order.end(), [&ranges](int a, int b) { return ranges[a] < ranges[b]; });
+
+	Cursors cursors;
+	const auto primary = GetCursors(cursors);
+	std::vector<std::array<Position, 3>> positions(cursors.size());
+	for (size_t i = 0; i < cursors.size(); ++i)
+	{
+		positions[i] = {{ toPosition(cursors[i].mCursorPosition), toPosition(cursors[i].mSelectionStart), toPosition(cursors[i].mSelectionEnd) }};
+	}
+
+	std::vector<std::array<bool, 3>> moved(cursors.size(), {{ false, false, false }});
+
+	// First line and count of the lines each edit left behind, and the change in the number of lines
+	struct Touched
+	{
+		int mLine;
+		int mLines;
+		int mDelta;
+	};
+	std::vector<Touched> touched;
+
+	BeginEdit();
+
+	auto limit = Position(std::numeric_limits<int>::max(), 0);
+	for (size_t k = order.size(); k-- > 0; )
+	{
+		auto& edit = aEdits[order[k]];
+		const auto& range = ranges[order[k]];
+		if (range.second > limit || (range.first == range.second && edit.mText.empty()))
+		{
+			continue; // Overlaps the edit below, or does nothing
+		}
+
+		limit = range.first;
+		const auto start = toCoordinates(range.first);
+		const auto end = toCoordinates(range.second);
+
+		UndoRecord u;
+		if (start != end)
+		{
+			u.mRemoved = GetText(start, end);
+			u.mRemovedStart = start;
+			u.mRemovedEnd = end;
+			DeleteRange(start, end);
+		}
+
+		auto pos = start;
+		if (!edit.mText.empty())
+		{
+			u.mAdded = edit.mText;
+			u.mAddedStart = start;
+			InsertTextAt(pos, edit.mText.c_str());
+			u.mAddedEnd = pos;
+		}
+
+		AddUndo(u);
+
+		const auto newEnd = Position(pos.mLine, GetCharacterIndex(pos));
+		for (size_t i = 0; i < positions.size(); ++i)
+		{
+			for (size_t j = 0; j < positions[i].size(); ++j)
+			{
+				// A position moved back to where an insertion is made was after it to begin with
+				auto& p = positions[i][j];
+				if (p < range.first || (p == range.first && !moved[i][j]))
+				{
+					continue;
+				}
+				else if (p < range.second)
+				{
+					p = newEnd; // Within the text replaced
+				}
+				else if (p.first == range.second.first)
+				{
+					p = Position(newEnd.first, newEnd.second + p.second - range.second.second);
+				}
+				else
+				{
+					p.first += newEnd.first - range.second.first;
+				}
+
+				moved[i][j] = true;
+			}
+		}
+
+		Touched t = { start.mLine, pos.mLine - start.mLine + 1, pos.mLine - end.mLine };
+		touched.push_back(t);
+	}
+
+	for (size_t i = 0; i < cursors.size(); ++i)
+	{
+		cursors[i].mCursorPosition = toCoordinates(positions[i][0]);
+		cursors[i].mSelectionStart = toCoordinates(positions[i][1]);
+		cursors[i].mSelectionEnd = toCoordinates(positions[i][2]);
+	}
+
+	SetCursors(cursors, primary);
+	MergeCursors();
+	mInteractiveStart = mState.mSelectionStart;
+	mInteractiveEnd = mState.mSelectionEnd;
+
+	// Colorize() would take every line between the first edit and the last one, so the lines are done here
+	if (mColorizerEnabled && !touched.empty())
+	{
+		int offset = 0;
+		int from = 0, to = 0;
+		for (size_t i = touched.size(); i-- > 0; )
+		{
+			const int first = std::max(0, touched[i].mLine + offset - 1);
+			const int last = touched[i].mLine + offset + touched[i].mLines + 1;
+			offset += touched[i].mDelta;
+			if (first > to)
+			{
+				ColorizeRange(from, to);
+				from = first;
+			}
+
+			to = std::max(to, last);
+		}
+
+		ColorizeRange(from, to);
+		mCheckComments = true;
+	}
+
+	EndEdit();
+}
+
 void TextEditor::DeleteSelection()
 {
 	assert(mState.mSelectionEnd >= mState.mSelectionStart);
@@ -1766,6 +4479,12 @@ void TextEditor::DeleteSelection()
 
 void TextEditor::MoveUp(int aAmount, bool aSelect)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveUp(aAmount, aSelect); });
+		return;
+	}
+
 	auto oldPos = mState.mCursorPosition;
 	mState.mCursorPosition.mLine = std::max(0, mState.mCursorPosition.mLine - aAmount);
 	if (oldPos != mState.mCursorPosition)
@@ -1799,6 +4518,12 @@ void TextEditor::MoveUp(int aAmount, bool aSelect)
 
 void TextEditor::MoveDown(int aAmount, bool aSelect)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveDown(aAmount, aSelect); });
+		return;
+	}
+
 	assert(mState.mCursorPosition.mColumn >= 0);
 	auto oldPos = mState.mCursorPosition;
 	mState.mCursorPosition.mLine = std::max(0, std::min((int)mLines.size() - 1, mState.mCursorPosition.mLine + aAmount));
@@ -1839,6 +4564,12 @@ static bool IsUTFSequence(char c)
 
 void TextEditor::MoveLeft(int aAmount, bool aSelect, bool aWordMode)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveLeft(aAmount, aSelect, aWordMode); });
+		return;
+	}
+
 	if (mLines.empty())
 	{
 		return;
@@ -1920,6 +4651,12 @@ void TextEditor::MoveLeft(int aAmount, bool aSelect, bool aWordMode)
 
 void TextEditor::MoveRight(int aAmount, bool aSelect, bool aWordMode)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveRight(aAmount, aSelect, aWordMode); });
+		return;
+	}
+
 	auto oldPos = mState.mCursorPosition;
 
 	if (mLines.empty() || oldPos.mLine >= mLines.size())
@@ -1984,6 +4721,12 @@ void TextEditor::MoveRight(int aAmount, bool aSelect, bool aWordMode)
 
 void TextEditor::MoveTop(bool aSelect)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveTop(aSelect); });
+		return;
+	}
+
 	auto oldPos = mState.mCursorPosition;
 	SetCursorPosition(Coordinates(0, 0));
 
@@ -2005,6 +4748,12 @@ void TextEditor::MoveTop(bool aSelect)
 
 void TextEditor::TextEditor::MoveBottom(bool aSelect)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveBottom(aSelect); });
+		return;
+	}
+
 	auto oldPos = GetCursorPosition();
 	auto newPos = Coordinates((int)mLines.size() - 1, 0);
 	SetCursorPosition(newPos);
@@ -2023,6 +4772,12 @@ void TextEditor::TextEditor::MoveBottom(bool aSelect)
 
 void TextEditor::MoveHome(bool aSelect)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveHome(aSelect); });
+		return;
+	}
+
 	auto oldPos = mState.mCursorPosition;
 	SetCursorPosition(Coordinates(mState.mCursorPosition.mLine, 0));
 
@@ -2055,6 +4810,12 @@ void TextEditor::MoveHome(bool aSelect)
 
 void TextEditor::MoveEnd(bool aSelect)
 {
+	if (!mExtraCursors.empty())
+	{
+		ForEachCursor([=]() { MoveEnd(aSelect); });
+		return;
+	}
+
 	auto oldPos = mState.mCursorPosition;
 	SetCursorPosition(Coordinates(mState.mCursorPosition.mLine, GetLineMaxColumn(oldPos.mLine)));
 
@@ -2089,6 +4850,12 @@ void TextEditor::Delete()
 {
 	assert(!mReadOnly);
 
+	if (!mExtraCursors.empty())
+	{
+		EditCursors([=]() { Delete(); });
+		return;
+	}
+
 	if (mLines.empty())
 	{
 		return;
@@ -2107,9 +4874,12 @@ void TextEditor::Delete()
 	}
 	else
 	{
+		// A cursor inside a tab is moved after it, where GetCharacterIndex() puts it
 		auto pos = GetActualCursorCoordinates();
+		pos.mColumn = GetCharacterColumn(pos.mLine, GetCharacterIndex(pos));
 		SetCursorPosition(pos);
 		auto& line = mLines[pos.mLine];
+		u.mKind = UndoKind::Delete;
 
 		if (pos.mColumn == GetLineMaxColumn(pos.mLine))
 		{
@@ -2124,23 +4894,32 @@ void TextEditor::Delete()
 
 			auto& nextLine = mLines[pos.mLine + 1];
 			line.insert(line.end(), nextLine.begin(), nextLine.end());
+			line.Touch();
+			mLineWidths.MarkDirty(pos.mLine);
+			MergeLineMarkers(pos.mLine + 1, pos.mLine);
 			RemoveLine(pos.mLine + 1);
 		}
 		else
 		{
+			// Columns are taken from the glyphs, since a tab may span less than a full tab size
 			auto cindex = GetCharacterIndex(pos);
-			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
-			u.mRemovedEnd.mColumn++;
+			auto d = std::min(UTF8CharLength(line[cindex].mChar), (int)line.size() - cindex);
+			u.mRemovedStart = Coordinates(pos.mLine, GetCharacterColumn(pos.mLine, cindex));
+			u.mRemovedEnd = Coordinates(pos.mLine, GetCharacterColumn(pos.mLine, cindex + d));
 			u.mRemoved = GetText(u.mRemovedStart, u.mRemovedEnd);
 
-			auto d = UTF8CharLength(line[cindex].mChar);
 			while (d-- > 0 && cindex < (int)line.size())
 			{
 				line.erase(line.begin() + cindex);
 			}
+
+			line.Touch();
+			mLineWidths.MarkDirty(pos.mLine);
 		}
 
 		mTextChanged = true;
+		++mTextRevision;
+		InvalidateFindMatches(pos.mLine, pos.mLine + 1);
 
 		Colorize(pos.mLine, 1);
 	}
@@ -2153,6 +4932,12 @@ void TextEditor::Backspace()
 {
 	assert(!mReadOnly);
 
+	if (!mExtraCursors.empty())
+	{
+		EditCursors([=]() { Backspace(); });
+		return;
+	}
+
 	if (mLines.empty())
 	{
 		return;
@@ -2172,7 +4957,9 @@ void TextEditor::Backspace()
 	else
 	{
 		auto pos = GetActualCursorCoordinates();
+		pos.mColumn = GetCharacterColumn(pos.mLine, GetCharacterIndex(pos));
 		SetCursorPosition(pos);
+		u.mKind = UndoKind::Backspace;
 
 		if (mState.mCursorPosition.mColumn == 0)
 		{
@@ -2189,15 +4976,10 @@ void TextEditor::Backspace()
 			auto& prevLine = mLines[mState.mCursorPosition.mLine - 1];
 			auto prevSize = GetLineMaxColumn(mState.mCursorPosition.mLine - 1);
 			prevLine.insert(prevLine.end(), line.begin(), line.end());
+			prevLine.Touch();
+			mLineWidths.MarkDirty(mState.mCursorPosition.mLine - 1);
 
-			ErrorMarkers etmp;
-			for (auto& i : mErrorMarkers)
-			{
-				etmp.insert(ErrorMarkers::value_type(i.first - 1 == mState.mCursorPosition.mLine ? i.first - 1 : i.first, i.second));
-			}
-
-			mErrorMarkers = std::move(etmp);
-
+			MergeLineMarkers(mState.mCursorPosition.mLine, mState.mCursorPosition.mLine - 1);
 			RemoveLine(mState.mCursorPosition.mLine);
 			--mState.mCursorPosition.mLine;
 			mState.mCursorPosition.mColumn = prevSize;
@@ -2212,26 +4994,24 @@ void TextEditor::Backspace()
 				--cindex;
 			}
 
-			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
-			--u.mRemovedStart.mColumn;
-
-			if (line[cindex].mChar == '\t')
-			{
-				mState.mCursorPosition.mColumn -= mTabSize;
-			}
-			else
-			{
-				--mState.mCursorPosition.mColumn;
-			}
+			// A tab may span less than a full tab size, so the column is taken from the glyph
+			u.mRemovedEnd = GetActualCursorCoordinates();
+			u.mRemovedStart = Coordinates(pos.mLine, GetCharacterColumn(pos.mLine, cindex));
+			mState.mCursorPosition.mColumn = u.mRemovedStart.mColumn;
 
 			while (cindex < line.size() && cend-- > cindex)
 			{
 				u.mRemoved += line[cindex].mChar;
 				line.erase(line.begin() + cindex);
 			}
+
+			line.Touch();
+			mLineWidths.MarkDirty(mState.mCursorPosition.mLine);
 		}
 
 		mTextChanged = true;
+		++mTextRevision;
+		InvalidateFindMatches(mState.mCursorPosition.mLine, mState.mCursorPosition.mLine + 1);
 
 		EnsureCursorVisible();
 		Colorize(mState.mCursorPosition.mLine, 1);
@@ -2249,6 +5029,7 @@ void TextEditor::SelectWordUnderCursor()
 
 void TextEditor::SelectAll()
 {
+	mExtraCursors.clear();
 	SetSelection(Coordinates(0, 0), Coordinates((int)mLines.size(), 0));
 }
 
@@ -2259,6 +5040,28 @@ bool TextEditor::HasSelection() const
 
 void TextEditor::Copy()
 {
+	if (!mExtraCursors.empty())
+	{
+		// The selections of every cursor, one per line
+		Cursors cursors;
+		GetCursors(cursors);
+		std::string text;
+		for (auto& cursor : cursors)
+		{
+			if (cursor.mSelectionStart < cursor.mSelectionEnd)
+			{
+				text += text.empty() ? "" : "\n";
+				text += GetText(cursor.mSelectionStart, cursor.mSelectionEnd);
+			}
+		}
+
+		if (!text.empty())
+		{
+			ImGui::SetClipboardText(text.c_str());
+			return;
+		}
+	}
+
 	if (HasSelection())
 	{
 		ImGui::SetClipboardText(GetSelectedText().c_str());
@@ -2285,6 +5088,15 @@ void TextEditor::Cut()
 	{
 		Copy();
 	}
+	else if (!mExtraCursors.empty())
+	{
+		// Every selection is copied at once, the cuts at each cursor would overwrite one another
+		Copy();
+		auto clipText = ImGui::GetClipboardText();
+		std::string text = clipText != nullptr ? clipText : "";
+		EditCursors([this]() { Cut(); });
+		ImGui::SetClipboardText(text.c_str());
+	}
 	else
 	{
 		if (HasSelection())
@@ -2311,6 +5123,12 @@ void TextEditor::Paste()
 		return;
 	}
 
+	if (!mExtraCursors.empty())
+	{
+		EditCursors([this]() { Paste(); });
+		return;
+	}
+
 	auto clipText = ImGui::GetClipboardText();
 	if (clipText != nullptr && strlen(clipText) > 0)
 	{
@@ -2325,11 +5143,19 @@ void TextEditor::Paste()
 			DeleteSelection();
 		}
 
-		u.mAdded = clipText;
 		u.mAddedStart = GetActualCursorCoordinates();
 
-		InsertText(clipText);
+		InsertTextInternal(clipText);
+
+		if (IsInserting())
+		{
+			// Completed and added once all of the text is in, see ContinueInsert()
+			mInsertRecord = std::move(u);
+			mInsertUndo = true;
+			return;
+		}
 
+		u.mAdded = clipText;
 		u.mAddedEnd = GetActualCursorCoordinates();
 		u.mAfter = mState;
 		AddUndo(u);
@@ -2338,28 +5164,38 @@ void TextEditor::Paste()
 
 bool TextEditor::CanUndo() const
 {
-	return !mReadOnly && mUndoIndex > 0;
+	return !IsReadOnly() && mEditDepth == 0 && mUndoNode != -1;
 }
 
 bool TextEditor::CanRedo() const
 {
-	return !mReadOnly && mUndoIndex < (int)mUndoBuffer.size();
+	return !IsReadOnly() && mEditDepth == 0 && (mUndoNode == -1 ? mUndoRootRedoChild : GetUndoRecord(mUndoNode).mRedoChild) != -1;
 }
 
 void TextEditor::Undo(int aSteps)
 {
+	mUndoMergeDeadline = -DBL_MAX;
 	while (CanUndo() && aSteps-- > 0)
 	{
-		mUndoBuffer[--mUndoIndex].Undo(this);
+		auto& record = GetUndoRecord(mUndoNode);
+		record.Undo(this);
+		GetUndoRedoChild(record.mParent) = mUndoNode;
+		mUndoNode = record.mParent;
 	}
+
+	EnsureCursorVisible();
 }
 
 void TextEditor::Redo(int aSteps)
 {
+	mUndoMergeDeadline = -DBL_MAX;
 	while (CanRedo() && aSteps-- > 0)
 	{
-		mUndoBuffer[mUndoIndex++].Redo(this);
+		mUndoNode = GetUndoRedoChild(mUndoNode);
+		GetUndoRecord(mUndoNode).Redo(this);
 	}
+
+	EnsureCursorVisible();
 }
 
 const TextEditor::Palette & TextEditor::GetColorPalette()
@@ -2387,6 +5223,9 @@ const TextEditor::Palette & TextEditor::GetColorPalette()
 		0x40000000, // Current line fill
 		0x40808080, // Current line fill (inactive)
 		0x40a0a0a0, // Current line edge
+		0xff3838f0, // Diagnostic error
+		0xff30c0f0, // Diagnostic warning
+		0xffe0a050, // Diagnostic info
 	} };
 
 	return palette;
@@ -2437,6 +5276,14 @@ void TextEditor::ProcessInputs()
 void TextEditor::Colorize(int aFromLine, int aLines)
 {
 	int toLine = aLines == -1 ? (int)mLines.size() : std::min((int)mLines.size(), aFromLine + aLines);
+	if (mUndoJumping)
+	{
+		// As the first line and the lines left after the range, which stay the same through later edits
+		mUndoJumpColorFirst = std::min(mUndoJumpColorFirst, aFromLine);
+		mUndoJumpColorTail = std::min(mUndoJumpColorTail, (int)mLines.size() - toLine);
+		return;
+	}
+
 	mColorRangeMin = std::min(mColorRangeMin, aFromLine);
 	mColorRangeMax = std::max(mColorRangeMax, toLine);
 	mColorRangeMin = std::max(0, mColorRangeMin);
@@ -2451,9 +5298,10 @@ void TextEditor::ColorizeRange(int aFromLine, int aToLine)
 		return;
 	}
 
-	std::string buffer;
-	std::cmatch results;
-	std::string id;
+	auto& buffer = mColorizeBuffer;
+	auto& colors = mColorizeColors;
+	auto& results = mColorizeMatch;
+	auto& id = mColorizeId;
 
 	int endLine = std::max(0, std::min((int)mLines.size(), aToLine));
 	for (int i = aFromLine; i < endLine; ++i)
@@ -2468,11 +5316,11 @@ void TextEditor::ColorizeRange(int aFromLine, int aToLine)
 		buffer.resize(line.size());
 		for (size_t j = 0; j < line.size(); ++j)
 		{
-			auto& col = line[j];
-			buffer[j] = col.mChar;
-			col.mColorIndex = PaletteIndex::Default;
+			buffer[j] = line[j].mChar;
 		}
 
+		colors.assign(line.size(), PaletteIndex::Default);
+
 		const char * bufferBegin = &buffer.front();
 		const char * bufferEnd = bufferBegin + buffer.size();
 
@@ -2555,12 +5403,28 @@ void TextEditor::ColorizeRange(int aFromLine, int aToLine)
 
 				for (size_t j = 0; j < token_length; ++j)
 				{
-					line[(token_begin - bufferBegin) + j].mColorIndex = token_color;
+					colors[(token_begin - bufferBegin) + j] = token_color;
 				}
 
 				first = token_end;
 			}
 		}
+
+		// Only lines whose colors actually changed get a new revision
+		bool changed = false;
+		for (size_t j = 0; j < line.size(); ++j)
+		{
+			if (line[j].mColorIndex != colors[j])
+			{
+				line[j].mColorIndex = colors[j];
+				changed = true;
+			}
+		}
+
+		if (changed)
+		{
+			line.Touch();
+		}
 	}
 }
 
@@ -2584,6 +5448,7 @@ void TextEditor::ColorizeInternal()
 		auto concatenate = false; // '\' on the very end of the line
 		auto currentLine = 0;
 		auto currentIndex = 0;
+		auto changed = false; // whether the flags of any glyph in the current line changed
 		while (currentLine < endLine || currentIndex < endIndex)
 		{
 			auto& line = mLines[currentLine];
@@ -2616,6 +5481,7 @@ void TextEditor::ColorizeInternal()
 
 				if (withinString)
 				{
+					changed |= line[currentIndex].mMultiLineComment != inComment;
 					line[currentIndex].mMultiLineComment = inComment;
 
 					if (c == '\"')
@@ -2624,7 +5490,10 @@ void TextEditor::ColorizeInternal()
 						{
 							currentIndex += 1;
 							if (currentIndex < (int)line.size())
+							{
+								changed |= line[currentIndex].mMultiLineComment != inComment;
 								line[currentIndex].mMultiLineComment = inComment;
+							}
 						}
 						else
 						{
@@ -2636,6 +5505,7 @@ void TextEditor::ColorizeInternal()
 						currentIndex += 1;
 						if (currentIndex < (int)line.size())
 						{
+							changed |= line[currentIndex].mMultiLineComment != inComment;
 							line[currentIndex].mMultiLineComment = inComment;
 						}
 					}
@@ -2650,6 +5520,7 @@ void TextEditor::ColorizeInternal()
 					if (c == '\"')
 					{
 						withinString = true;
+						changed |= line[currentIndex].mMultiLineComment != inComment;
 						line[currentIndex].mMultiLineComment = inComment;
 					}
 					else
@@ -2674,7 +5545,9 @@ void TextEditor::ColorizeInternal()
 
 						inComment = inComment = (commentStartLine < currentLine || (commentStartLine == currentLine && commentStartIndex <= currentIndex));
 
+						changed |= line[currentIndex].mMultiLineComment != inComment;
 						line[currentIndex].mMultiLineComment = inComment;
+						changed |= line[currentIndex].mComment != withinSingleLineComment;
 						line[currentIndex].mComment = withinSingleLineComment;
 
 						auto& endStr = mLanguageDefinition.mCommentEnd;
@@ -2687,10 +5560,17 @@ void TextEditor::ColorizeInternal()
 					}
 				}
 
+				changed |= line[currentIndex].mPreprocessor != withinPreproc;
 				line[currentIndex].mPreprocessor = withinPreproc;
 				currentIndex += UTF8CharLength(c);
 				if (currentIndex >= (int)line.size())
 				{
+					if (changed)
+					{
+						line.Touch();
+						changed = false;
+					}
+
 					currentIndex = 0;
 					++currentLine;
 				}
@@ -2702,65 +5582,571 @@ void TextEditor::ColorizeInternal()
 			}
 		}
 
-		mCheckComments = false;
+		mCheckComments = false;
+	}
+
+	if (mColorRangeMin < mColorRangeMax)
+	{
+		const int increment = (mLanguageDefinition.mTokenize == nullptr) ? 10 : 10000;
+		const int to = std::min(mColorRangeMin + increment, mColorRangeMax);
+		ColorizeRange(mColorRangeMin, to);
+		mColorRangeMin = to;
+
+		if (mColorRangeMax == mColorRangeMin)
+		{
+			mColorRangeMin = std::numeric_limits<int>::max();
+			mColorRangeMax = 0;
+		}
+	}
+}
+
+float TextEditor::TextDistanceToLineStart(const Coordinates& aFrom) const
+{
+	return mFixedPitch ? TextDistanceToLineStart<true>(aFrom) : TextDistanceToLineStart<false>(aFrom);
+}
+
+template <bool FixedPitch>
+float TextEditor::TextDistanceToLineStart(const Coordinates& aFrom) const
+{
+	auto& layout = GetLineLayout(aFrom.mLine);
+
+	// The first glyph boundary at or after the column, or the end of the line
+	auto it = std::lower_bound(layout.mColumns.begin(), layout.mColumns.end() - 1, aFrom.mColumn);
+	return layout.mOffsets[it - layout.mColumns.begin()];
+}
+
+const TextEditor::LineLayout& TextEditor::GetLineLayout(int aLine) const
+{
+	auto& line = mLines[aLine];
+	auto& layout = mLineLayouts[line.GetRevision()];
+	layout.mLastUsedFrame = ImGui::GetFrameCount();
+
+	if (!layout.mOffsets.empty() && layout.mAdvances == mGlyphAdvances && layout.mTabSize == mTabSize && layout.mLengthLimit == mLineLengthLimit)
+	{
+		return layout;
+	}
+
+	layout.mAdvances = mGlyphAdvances;
+	layout.mTabSize = mTabSize;
+	layout.mLengthLimit = mLineLengthLimit;
+	layout.mColumns.clear();
+	layout.mOffsets.clear();
+
+	layout.mCells = true;
+
+	const int end = mLineLengthLimit > 0 ? std::min((int)line.size(), mLineLengthLimit) : (int)line.size();
+	int column = 0;
+	float x = 0.0f;
+	int i = 0;
+	while (i < end)
+	{
+		layout.mColumns.push_back(column);
+		layout.mOffsets.push_back(x);
+		layout.mCells = layout.mCells && line[i].mChar < 0x80;
+
+		if (line[i].mChar == '\t')
+		{
+			x = mGlyphAdvances->GetNextTabStop(x, mTabSize);
+			column = (column / mTabSize) * mTabSize + mTabSize;
+			++i;
+		}
+		else
+		{
+			auto d = std::min(UTF8CharLength(line[i].mChar), (int)line.size() - i);
+			x += mGlyphAdvances->GetAdvance(&line[i], d);
+			++column;
+			i += d;
+		}
+	}
+
+	layout.mColumns.push_back(column);
+	layout.mOffsets.push_back(x);
+	layout.mTruncated = i < (int)line.size();
+	layout.mMaxColumn = layout.mTruncated ? GetLineMaxColumn(aLine) : column;
+
+	return layout;
+}
+
+const TextEditor::LineDrawing& TextEditor::GetLineDrawing(int aLine)
+{
+	auto& line = mLines[aLine];
+	auto& drawing = mLineDrawings[line.GetRevision()];
+	drawing.mLastUsedFrame = ImGui::GetFrameCount();
+
+	if (drawing.mAdvances == mGlyphAdvances && drawing.mTabSize == mTabSize && drawing.mLengthLimit == mLineLengthLimit &&
+		drawing.mFixedPitch == mFixedPitch && drawing.mPaletteRevision == mPaletteRevision)
+	{
+		return drawing;
+	}
+
+	drawing.mAdvances = mGlyphAdvances;
+	drawing.mTabSize = mTabSize;
+	drawing.mLengthLimit = mLineLengthLimit;
+	drawing.mFixedPitch = mFixedPitch;
+	drawing.mPaletteRevision = mPaletteRevision;
+	drawing.mQuads.clear();
+	drawing.mWhitespaces.clear();
+
+	// Glyphs without a visible quad (e.g. control characters) only move the pen
+	const ImFont* font = ImGui::GetFont();
+	const float scale = ImGui::GetFontSize() / font->FontSize;
+	auto addQuad = [&](unsigned int aCodepoint, float aX, ImU32 aColor)
+	{
+		auto fontGlyph = font->FindGlyph((ImWchar)aCodepoint);
+		if (fontGlyph != nullptr && fontGlyph->Visible)
+		{
+			LineDrawing::Quad quad = { aX, aColor, (ImWchar)aCodepoint };
+			drawing.mQuads.push_back(quad);
+		}
+	};
+
+	const float spaceSize = mGlyphAdvances->GetSpaceSize();
+	float x = 0.0f;
+
+	const int end = mLineLengthLimit > 0 ? std::min((int)line.size(), mLineLengthLimit) : (int)line.size();
+	int i = 0;
+	while (i < end)
+	{
+		auto& glyph = line[i];
+
+		if (glyph.mChar == '\t')
+		{
+			LineDrawing::Whitespace tab = { x, mGlyphAdvances->GetNextTabStop(x, mTabSize), true };
+			drawing.mWhitespaces.push_back(tab);
+			x = tab.mX2;
+			++i;
+		}
+		else if (glyph.mChar == ' ')
+		{
+			LineDrawing::Whitespace space = { x, x + spaceSize, false };
+			drawing.mWhitespaces.push_back(space);
+			x = space.mX2;
+			++i;
+		}
+		else
+		{
+			auto l = std::min(UTF8CharLength(glyph.mChar), (int)line.size() - i);
+			addQuad(UTF8ToCodepoint(&glyph, l), x, GetGlyphColor(glyph));
+			x += mFixedPitch && l == 1 ? mCharAdvance.x : mGlyphAdvances->GetAdvance(&glyph, l);
+			i += l;
+		}
+	}
+
+	// Truncated lines end with an indicator of how much is not shown
+	if (i < (int)line.size())
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "  ... (+%d bytes)", (int)line.size() - i);
+
+		for (auto p = buf; *p != '\0'; ++p)
+		{
+			addQuad((unsigned char)*p, x, mPalette[(int)PaletteIndex::LineNumber]);
+			x += font->GetCharAdvance((ImWchar)(unsigned char)*p) * scale;
+		}
+	}
+
+	return drawing;
+}
+
+template <class Caches>
+static void PruneUnusedEntries(Caches& aCaches, int aFrame)
+{
+	for (auto it = aCaches.begin(); it != aCaches.end(); )
+	{
+		if (it->second.mLastUsedFrame < aFrame - 1)
+		{
+			it = aCaches.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void TextEditor::PruneLineCaches(int aVisibleLines)
+{
+	// Line caches are rebuilt on demand, so only entries used during the last frame are worth keeping.
+	// This drops the entries of old line revisions and of lines scrolled out of view.
+	const int frame = ImGui::GetFrameCount();
+	const int limit = 2 * aVisibleLines + 64;
+
+	if ((int)mLineLayouts.size() > limit)
+	{
+		PruneUnusedEntries(mLineLayouts, frame);
+	}
+
+	if ((int)mLineDrawings.size() > limit)
+	{
+		PruneUnusedEntries(mLineDrawings, frame);
+	}
+}
+
+float TextEditor::MeasureLineWidth(int aLine) const
+{
+	auto& line = mLines[aLine];
+
+	auto it = mLineLayouts.find(line.GetRevision());
+	if (it != mLineLayouts.end() && !it->second.mOffsets.empty() && it->second.mAdvances == mGlyphAdvances &&
+		it->second.mTabSize == mTabSize && it->second.mLengthLimit == mLineLengthLimit)
+	{
+		return it->second.mOffsets.back();
+	}
+
+	// Same walk as GetLineLayout, without filling the layout cache
+	const int end = mLineLengthLimit > 0 ? std::min((int)line.size(), mLineLengthLimit) : (int)line.size();
+	float x = 0.0f;
+	int i = 0;
+	while (i < end)
+	{
+		if (line[i].mChar == '\t')
+		{
+			x = mGlyphAdvances->GetNextTabStop(x, mTabSize);
+			++i;
+		}
+		else
+		{
+			auto d = std::min(UTF8CharLength(line[i].mChar), (int)line.size() - i);
+			x += mGlyphAdvances->GetAdvance(&line[i], d);
+			i += d;
+		}
+	}
+
+	return x;
+}
+
+void TextEditor::UpdateLineWidths()
+{
+	if (mLineWidthsAdvances != mGlyphAdvances || mLineWidthsTabSize != mTabSize || mLineWidthsLengthLimit != mLineLengthLimit)
+	{
+		mLineWidthsAdvances = mGlyphAdvances;
+		mLineWidthsTabSize = mTabSize;
+		mLineWidthsLengthLimit = mLineLengthLimit;
+		mLineWidths.Reset((int)mLines.size());
+	}
+
+	// Bounds the time spent per frame after a reset; until then the extent only grows as lines get measured
+	int budget = 256 * 1024;
+
+	int lineNo;
+	while (budget > 0 && mLineWidths.PopDirty(lineNo))
+	{
+		auto& line = mLines[lineNo];
+		if (mLineWidths.GetRevision(lineNo) != line.GetRevision())
+		{
+			mLineWidths.SetWidth(lineNo, line.GetRevision(), MeasureLineWidth(lineNo));
+			budget -= (int)line.size() + 16;
+		}
+	}
+}
+
+// The distance is the column aFrom snaps to (the end of a tab or of the line) times the cell width
+template <>
+float TextEditor::TextDistanceToLineStart<true>(const Coordinates& aFrom) const
+{
+	auto& layout = GetLineLayout(aFrom.mLine);
+	if (!layout.mCells)
+	{
+		return TextDistanceToLineStart<false>(aFrom);
+	}
+
+	auto& columns = layout.mColumns;
+	return *std::lower_bound(columns.begin(), columns.end() - 1, aFrom.mColumn) * mCharAdvance.x;
+}
+
+TextEditor::LineWidthIndex::LineWidthIndex()
+	: mSweep(0)
+{
+}
+
+void TextEditor::LineWidthIndex::Reset(int aLines)
+{
+	mWidths.assign(aLines, 0.0f);
+	mRevisions.assign(aLines, 0);
+	mDirty.clear();
+	mWidthCounts.clear();
+	mSweep = 0;
+}
+
+void TextEditor::LineWidthIndex::InsertLines(int aIndex, int aCount)
+{
+	mWidths.insert(mWidths.begin() + aIndex, aCount, 0.0f);
+	mRevisions.insert(mRevisions.begin() + aIndex, aCount, 0);
+
+	// Only lines marked since the last frame are queued, so shifting them is cheap
+	for (auto& line : mDirty)
+	{
+		if (line >= aIndex)
+		{
+			line += aCount;
+		}
+	}
+
+	if (aIndex < mSweep)
+	{
+		mSweep += aCount;
+		for (int i = 0; i < aCount; ++i)
+		{
+			mDirty.push_back(aIndex + i);
+		}
+	}
+}
+
+void TextEditor::LineWidthIndex::RemoveLines(int aStart, int aEnd)
+{
+	for (int i = aStart; i < aEnd; ++i)
+	{
+		RemoveWidth(mWidths[i]);
+	}
+
+	mWidths.erase(mWidths.begin() + aStart, mWidths.begin() + aEnd);
+	mRevisions.erase(mRevisions.begin() + aStart, mRevisions.begin() + aEnd);
+
+	auto last = std::remove_if(mDirty.begin(), mDirty.end(), [&](int aLine) { return aLine >= aStart && aLine < aEnd; });
+	mDirty.erase(last, mDirty.end());
+
+	for (auto& line : mDirty)
+	{
+		if (line >= aEnd)
+		{
+			line -= aEnd - aStart;
+		}
+	}
+
+	if (mSweep >= aEnd)
+	{
+		mSweep -= aEnd - aStart;
+	}
+	else if (mSweep > aStart)
+	{
+		mSweep = aStart;
+	}
+}
+
+void TextEditor::LineWidthIndex::MarkDirty(int aLine)
+{
+	mDirty.push_back(aLine);
+}
+
+bool TextEditor::LineWidthIndex::PopDirty(int& aLine)
+{
+	if (!mDirty.empty())
+	{
+		aLine = mDirty.back();
+		mDirty.pop_back();
+		return true;
+	}
+
+	if (mSweep < (int)mWidths.size())
+	{
+		aLine = mSweep++;
+		return true;
+	}
+
+	return false;
+}
+
+void TextEditor::LineWidthIndex::SetWidth(int aLine, uint64_t aRevision, float aWidth)
+{
+	mRevisions[aLine] = aRevision;
+	if (mWidths[aLine] == aWidth)
+	{
+		return;
+	}
+
+	RemoveWidth(mWidths[aLine]);
+	mWidths[aLine] = aWidth;
+	AddWidth(aWidth);
+}
+
+float TextEditor::LineWidthIndex::GetMaxWidth() const
+{
+	return mWidthCounts.empty() ? 0.0f : mWidthCounts.rbegin()->first;
+}
+
+void TextEditor::LineWidthIndex::AddWidth(float aWidth)
+{
+	if (aWidth > 0.0f)
+	{
+		++mWidthCounts[aWidth];
+	}
+}
+
+void TextEditor::LineWidthIndex::RemoveWidth(float aWidth)
+{
+	if (aWidth > 0.0f)
+	{
+		auto it = mWidthCounts.find(aWidth);
+		if (--it->second == 0)
+		{
+			mWidthCounts.erase(it);
+		}
+	}
+}
+
+static void* DefaultAllocate(size_t aSize, void* /* aUserData */)
+{
+	return malloc(aSize);
+}
+
+static void DefaultFree(void* aPtr, void* /* aUserData */)
+{
+	free(aPtr);
+}
+
+static TextEditor::AllocateCallback sAllocate = DefaultAllocate;
+static TextEditor::FreeCallback sFree = DefaultFree;
+static void* sAllocatorUserData = nullptr;
+static std::atomic<uint64_t> sAllocationCount(0);
+static std::atomic<int> sActiveAllocationCount(0);
+
+void TextEditor::SetAllocatorFunctions(AllocateCallback aAllocate, FreeCallback aFree, void* aUserData)
+{
+	sAllocate = aAllocate;
+	sFree = aFree;
+	sAllocatorUserData = aUserData;
+}
+
+void* TextEditor::MemAlloc(size_t aSize)
+{
+	++sAllocationCount;
+	++sActiveAllocationCount;
+	return sAllocate(aSize, sAllocatorUserData);
+}
+
+void TextEditor::MemFree(void* aPtr)
+{
+	if (aPtr != nullptr)
+	{
+		--sActiveAllocationCount;
+	}
+
+	sFree(aPtr, sAllocatorUserData);
+}
+
+uint64_t TextEditor::GetAllocationCount()
+{
+	return sAllocationCount;
+}
+
+int TextEditor::GetActiveAllocationCount()
+{
+	return sActiveAllocationCount;
+}
+
+uint64_t TextEditor::Line::NewRevision()
+{
+	static std::atomic<uint64_t> revision(0);
+	return ++revision;
+}
+
+TextEditor::GlyphAdvanceCache::GlyphAdvanceCache(const ImFont* aFont, float aFontSize)
+	: mFont(aFont)
+	, mFontSize(aFontSize)
+	, mFixedPitch(true)
+{
+	char buf[2] = { 0, 0 };
+	for (int i = 0; i < 128; ++i)
+	{
+		buf[0] = (char)i;
+		mAscii[i] = i == 0 ? 0.0f : Measure(buf);
 	}
 
-	if (mColorRangeMin < mColorRangeMax)
+	for (int i = ' ' + 1; i < 127; ++i)
 	{
-		const int increment = (mLanguageDefinition.mTokenize == nullptr) ? 10 : 10000;
-		const int to = std::min(mColorRangeMin + increment, mColorRangeMax);
-		ColorizeRange(mColorRangeMin, to);
-		mColorRangeMin = to;
-
-		if (mColorRangeMax == mColorRangeMin)
+		if (mAscii[i] != mAscii[' '])
 		{
-			mColorRangeMin = std::numeric_limits<int>::max();
-			mColorRangeMax = 0;
+			mFixedPitch = false;
+			break;
 		}
 	}
 }
 
-float TextEditor::TextDistanceToLineStart(const Coordinates& aFrom) const
+std::shared_ptr<const TextEditor::GlyphAdvanceCache> TextEditor::GlyphAdvanceCache::Get(const ImFont* aFont, float aFontSize)
 {
-	auto& line = mLines[aFrom.mLine];
-	float distance = 0.0f;
-	float spaceSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, " ", nullptr, nullptr).x;
-	int colIndex = GetCharacterIndex(aFrom);
-	for (size_t it = 0u; it < line.size() && it < colIndex; )
+	auto& registry = GetRegistry();
+	auto& entry = registry[std::make_pair(aFont, aFontSize)];
+	auto cache = entry.lock();
+	if (!cache)
 	{
-		if (line[it].mChar == '\t')
+		// Forget the sizes no editor uses anymore, e.g. those passed through while zooming
+		for (auto it = registry.begin(); it != registry.end();)
 		{
-			distance = (1.0f + std::floor((1.0f + distance) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-			++it;
+			if (it->second.expired() && &it->second != &entry)
+				it = registry.erase(it);
+			else
+				++it;
 		}
-		else
-		{
-			auto d = UTF8CharLength(line[it].mChar);
-			char tempCString[7];
-			int i = 0;
-			for (; i < 6 && d-- > 0 && it < (int)line.size(); i++, it++)
-			{
-				tempCString[i] = line[it].mChar;
-			}
 
-			tempCString[i] = '\0';
-			distance += ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, tempCString, nullptr, nullptr).x;
-		}
+		cache = std::allocate_shared<GlyphAdvanceCache>(Allocator<GlyphAdvanceCache>(), aFont, aFontSize);
+		entry = cache;
+	}
+
+	return cache;
+}
+
+void TextEditor::GlyphAdvanceCache::Invalidate()
+{
+	// The editors keep their caches until they pick a new one in their next Render()
+	GetRegistry().clear();
+}
+
+TextEditor::GlyphAdvanceCache::Registry& TextEditor::GlyphAdvanceCache::GetRegistry()
+{
+	static Registry registry;
+	return registry;
+}
+
+float TextEditor::GlyphAdvanceCache::GetAdvance(const Glyph* aSequence, int aLength) const
+{
+	if (aLength == 1 && aSequence->mChar < 128)
+	{
+		return mAscii[aSequence->mChar];
+	}
+
+	char buf[7];
+	uint64_t key = 0;
+	int i = 0;
+	for (; i < 6 && i < aLength; ++i)
+	{
+		buf[i] = aSequence[i].mChar;
+		key = (key << 8) | aSequence[i].mChar;
+	}
+
+	buf[i] = '\0';
+
+	auto it = mOther.find(key);
+	if (it != mOther.end())
+	{
+		return it->second;
 	}
 
-	return distance;
+	auto advance = Measure(buf);
+	mOther.insert(std::make_pair(key, advance));
+	return advance;
+}
+
+float TextEditor::GlyphAdvanceCache::GetNextTabStop(float aX, int aTabSize) const
+{
+	const float tabWidth = float(aTabSize) * GetSpaceSize();
+	return (1.0f + std::floor((1.0f + aX) / tabWidth)) * tabWidth;
+}
+
+float TextEditor::GlyphAdvanceCache::Measure(const char* aText) const
+{
+	return mFont->CalcTextSizeA(mFontSize, FLT_MAX, -1.0f, aText, nullptr, nullptr).x;
 }
 
 void TextEditor::EnsureCursorVisible()
 {
-	if (!mWithinRender)
+	if (!mWithinRender || mEditDepth > 0)
 	{
 		mScrollToCursor = true;
 		return;
 	}
 
 	float scrollX = ImGui::GetScrollX();
-	float scrollY = ImGui::GetScrollY();
+	double scrollY = mScrollY;
 
 	auto height = ImGui::GetWindowHeight();
 	auto width = ImGui::GetWindowWidth();
@@ -2776,25 +6162,201 @@ void TextEditor::EnsureCursorVisible()
 
 	if (pos.mLine < top)
 	{
-		ImGui::SetScrollY(std::max(0.0f, (pos.mLine - 1) * mCharAdvance.y));
+		SetScrollY((pos.mLine - 1) * (double)mCharAdvance.y);
 	}
 	
 	if (pos.mLine > bottom - 4)
 	{
-		ImGui::SetScrollY(std::max(0.0f, (pos.mLine + 4) * mCharAdvance.y - height));
+		SetScrollY((pos.mLine + 4) * (double)mCharAdvance.y - height);
 	}
 	
 	if (len + mTextStart < left + 4)
 	{
+		mScrollRequested = true;
 		ImGui::SetScrollX(std::max(0.0f, len + mTextStart - 4));
 	}
 	
 	if (len + mTextStart > right - 4)
 	{
+		mScrollRequested = true;
 		ImGui::SetScrollX(std::max(0.0f, len + mTextStart + 4 - width));
 	}
 }
 
+void TextEditor::AddGutterColumn(float aWidth, GutterCallback aCallback, void* aUserData)
+{
+	Gutter::Column column = { aWidth, aCallback, aUserData };
+	mGutter.mColumns.push_back(column);
+	mGutter.mColumnsChanged = true;
+}
+
+void TextEditor::ClearGutterColumns()
+{
+	mGutter.mColumns.clear();
+	mGutter.mColumnsChanged = true;
+}
+
+void TextEditor::UpdateGutter()
+{
+	int digitCount = 1;
+	for (int count = (int)mLines.size(); count >= 10; count /= 10)
+	{
+		++digitCount;
+	}
+
+	if (mGutter.mAdvances == mGlyphAdvances && mGutter.mDigitCount == digitCount && !mGutter.mColumnsChanged)
+	{
+		return;
+	}
+
+	mGutter.mAdvances = mGlyphAdvances;
+	mGutter.mDigitCount = digitCount;
+	mGutter.mColumnsChanged = false;
+
+	const ImFont* font = ImGui::GetFont();
+	const float scale = ImGui::GetFontSize() / font->FontSize;
+	float digitAdvance = 0.0f;
+	for (int i = 0; i < 10; ++i)
+	{
+		mGutter.mDigitAdvances[i] = font->FindGlyph((ImWchar)('0' + i))->AdvanceX * scale;
+		digitAdvance = std::max(digitAdvance, mGutter.mDigitAdvances[i]);
+	}
+
+	float columnsWidth = 0.0f;
+	for (auto& column : mGutter.mColumns)
+	{
+		columnsWidth += column.mWidth;
+	}
+
+	// Room for the widest line number and two spaces before the text
+	mTextStart = mLeftMargin + columnsWidth + digitCount * digitAdvance + 2.0f * mGlyphAdvances->GetSpaceSize();
+}
+
+void TextEditor::RenderGutter(ImDrawList* aDrawList, float aLeft, int aFirstLine, int aLastLine)
+{
+	float x = aLeft + mLeftMargin;
+	for (auto& column : mGutter.mColumns)
+	{
+		for (int line = aFirstLine; line <= aLastLine; ++line)
+		{
+			const float y = GetLineScreenY(line);
+			column.mCallback(aDrawList, ImVec2(x, y), ImVec2(x + column.mWidth, y + mCharAdvance.y), line, column.mUserData);
+		}
+
+		x += column.mWidth;
+	}
+
+	// Line numbers, right aligned, with the quads of all visible lines reserved at once. The glyphs are looked up
+	// every frame, since their UVs change when the font atlas is rebuilt.
+	const ImFont* font = ImGui::GetFont();
+	const ImFontGlyph* digits[10];
+	for (int i = 0; i < 10; ++i)
+	{
+		digits[i] = font->FindGlyph((ImWchar)('0' + i));
+	}
+
+	int count = 0;
+	for (int line = aFirstLine; line <= aLastLine; ++line)
+	{
+		for (int number = line + 1; number > 0; number /= 10)
+		{
+			count += digits[number % 10]->Visible ? 1 : 0;
+		}
+	}
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	const float scale = ImGui::GetFontSize() / font->FontSize;
+	const ImU32 color = mPalette[(int)PaletteIndex::LineNumber];
+	const float right = aLeft + mTextStart - 2.0f * mGlyphAdvances->GetSpaceSize();
+
+	aDrawList->PrimReserve(count * 6, count * 4);
+	for (int line = aFirstLine; line <= aLastLine; ++line)
+	{
+		const float y = floorf(GetLineScreenY(line));
+		float x = right;
+		for (int number = line + 1; number > 0; number /= 10)
+		{
+			auto& glyph = *digits[number % 10];
+			x -= mGutter.mDigitAdvances[number % 10];
+			if (glyph.Visible)
+			{
+				const float x0 = floorf(x);
+				aDrawList->PrimRectUV(ImVec2(x0 + glyph.X0 * scale, y + glyph.Y0 * scale), ImVec2(x0 + glyph.X1 * scale, y + glyph.Y1 * scale),
+					ImVec2(glyph.U0, glyph.V0), ImVec2(glyph.U1, glyph.V1), color);
+			}
+		}
+	}
+}
+
+float TextEditor::GetLineScreenY(int aLine) const
+{
+	return mContentTopY + (float)(aLine * (double)mCharAdvance.y - mScrollY);
+}
+
+// Beyond this content height, ImGui scroll positions would lose sub-pixel precision
+static const double sMaxScrollHeight = 1 << 20;
+
+void TextEditor::UpdateScroll()
+{
+	mContentTopY = ImGui::GetCursorScreenPos().y + ImGui::GetScrollY();
+
+	const double documentHeight = mLines.size() * (double)mCharAdvance.y;
+	mScrollHeight = (float)std::min(documentHeight, sMaxScrollHeight);
+
+	const float scrollY = ImGui::GetScrollY();
+	if (documentHeight <= sMaxScrollHeight)
+	{
+		mScrollY = mImGuiScrollY = scrollY;
+		return;
+	}
+
+	// The mouse wheel scrolls by pixels, anything else (e.g. the scrollbar) picks a proportional position.
+	// Differences below a pixel come from ImGui rounding the position handed to it.
+	if (fabs(scrollY - mImGuiScrollY) >= 1.0f)
+	{
+		if (ImGui::GetIO().MouseWheel != 0.0f && ImGui::IsWindowHovered())
+		{
+			mScrollY += scrollY - mImGuiScrollY;
+		}
+		else
+		{
+			mScrollY = scrollY / GetScrollRatio();
+		}
+
+		mImGuiScrollY = scrollY;
+	}
+
+	// Keeps the scrollbar in sync after wheel scrolling, or when the document height changed the mapping
+	if (fabs(mScrollY * GetScrollRatio() - scrollY) >= 1.0f)
+	{
+		SetScrollY(mScrollY);
+	}
+}
+
+void TextEditor::SetScrollY(double aScrollY)
+{
+	// The scrollable range of ImGui, with the same slack below the last line as ImGui leaves
+	const double scrollMax = ImGui::GetScrollMaxY();
+	const double maxScrollY = mLines.size() * (double)mCharAdvance.y - (mScrollHeight - scrollMax);
+
+	mScrollY = std::max(0.0, std::min(aScrollY, maxScrollY));
+	mImGuiScrollY = (float)(mScrollY * GetScrollRatio());
+	mScrollRequested = true;
+	ImGui::SetScrollY(mImGuiScrollY);
+}
+
+double TextEditor::GetScrollRatio() const
+{
+	// ImGui scroll position per logical one, 1 unless the document is higher than sMaxScrollHeight
+	const double scrollMax = ImGui::GetScrollMaxY();
+	const double maxScrollY = mLines.size() * (double)mCharAdvance.y - (mScrollHeight - scrollMax);
+	return scrollMax > 0.0 && maxScrollY > scrollMax ? scrollMax / maxScrollY : 1.0;
+}
+
 int TextEditor::GetPageSize() const
 {
 	auto height = ImGui::GetWindowHeight() - 20.0f;
@@ -2810,55 +6372,361 @@ TextEditor::UndoRecord::UndoRecord(
 	const TextEditor::Coordinates aRemovedEnd,
 	TextEditor::EditorState& aBefore,
 	TextEditor::EditorState& aAfter)
-	: mAdded(aAdded)
-	, mAddedStart(aAddedStart)
-	, mAddedEnd(aAddedEnd)
-	, mRemoved(aRemoved)
-	, mRemovedStart(aRemovedStart)
-	, mRemovedEnd(aRemovedEnd)
-	, mBefore(aBefore)
+	: mBefore(aBefore)
 	, mAfter(aAfter)
+	, mKind(UndoKind::Other)
+	, mParent(-1)
+	, mRedoChild(-1)
+	, mTime(0.0)
+	, mDropped(false)
 {
+	mAdded = aAdded;
+	mAddedStart = aAddedStart;
+	mAddedEnd = aAddedEnd;
+	mRemoved = aRemoved;
+	mRemovedStart = aRemovedStart;
+	mRemovedEnd = aRemovedEnd;
+
 	assert(mAddedStart <= mAddedEnd);
 	assert(mRemovedStart <= mRemovedEnd);
 }
 
-void TextEditor::UndoRecord::Undo(TextEditor * aEditor)
+void TextEditor::UndoEdit::Undo(TextEditor * aEditor)
+{
+	if (!mMovedOrder.empty())
+	{
+		LineOrder order(mMovedOrder.size());
+		for (int i = 0; i < (int)mMovedOrder.size(); ++i)
+		{
+			order[mMovedOrder[i]] = i;
+		}
+
+		aEditor->ReorderLines(mMovedFirst, order);
+		return;
+	}
+
+	if (mByLine)
+	{
+		std::string text;
+		if (!mRemovedText.IsEmpty())
+		{
+			aEditor->mUndoArena.Read(mRemovedText, text);
+		}
+
+		aEditor->SetLineTexts(mRemovedStart.mLine, text);
+		return;
+	}
+
+	if (!mAddedText.IsEmpty())
+	{
+		aEditor->DeleteRange(mAddedStart, mAddedEnd);
+		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 2);
+	}
+
+	if (!mRemovedText.IsEmpty())
+	{
+		std::string text;
+		aEditor->mUndoArena.Read(mRemovedText, text);
+		auto start = mRemovedStart;
+		aEditor->InsertTextAt(start, text.c_str());
+		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 2);
+	}
+}
+
+void TextEditor::UndoEdit::Redo(TextEditor * aEditor)
+{
+	if (!mMovedOrder.empty())
+	{
+		aEditor->ReorderLines(mMovedFirst, mMovedOrder);
+		return;
+	}
+
+	if (mByLine)
+	{
+		std::string text;
+		if (!mAddedText.IsEmpty())
+		{
+			aEditor->mUndoArena.Read(mAddedText, text);
+		}
+
+		aEditor->SetLineTexts(mAddedStart.mLine, text);
+		return;
+	}
+
+	if (!mRemovedText.IsEmpty())
+	{
+		aEditor->DeleteRange(mRemovedStart, mRemovedEnd);
+		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 1);
+	}
+
+	if (!mAddedText.IsEmpty())
+	{
+		std::string text;
+		aEditor->mUndoArena.Read(mAddedText, text);
+		auto start = mAddedStart;
+		aEditor->InsertTextAt(start, text.c_str());
+		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 1);
+	}
+}
+
+void TextEditor::UndoRecord::Undo(TextEditor * aEditor)
+{
+	for (auto it = mEdits.rbegin(); it != mEdits.rend(); ++it)
+	{
+		it->Undo(aEditor);
+	}
+
+	UndoEdit::Undo(aEditor);
+	aEditor->mState = mBefore;
+	aEditor->mExtraCursors = mExtraBefore;
+}
+
+size_t TextEditor::UndoRecord::GetReplayCost() const
+{
+	size_t cost = sUndoRecordCost + mAddedText.mLength + mRemovedText.mLength + mMovedOrder.size() * sizeof(int);
+	for (auto& edit : mEdits)
+	{
+		cost += edit.mAddedText.mLength + edit.mRemovedText.mLength + edit.mMovedOrder.size() * sizeof(int);
+	}
+
+	return cost;
+}
+
+void TextEditor::UndoRecord::Redo(TextEditor * aEditor)
+{
+	UndoEdit::Redo(aEditor);
+	for (auto& edit : mEdits)
+	{
+		edit.Redo(aEditor);
+	}
+
+	aEditor->mState = mAfter;
+	aEditor->mExtraCursors = mExtraAfter;
+}
+
+// Most undo texts are a few characters, so they share blocks of this size
+static const size_t sUndoBlockSize = 64 * 1024;
+
+TextEditor::UndoArena::UndoArena()
+	: mFirstBlock(0)
+	, mFirstInMemory(0)
+	, mMemory(0)
+	, mTextSize(0)
+	, mSpillThreshold(16 * 1024 * 1024)
+	, mSpilledBlocks(0)
+	, mFile(nullptr)
+	, mFileSize(0)
+{
+}
+
+TextEditor::UndoArena::~UndoArena()
+{
+	if (mFile != nullptr)
+	{
+		std::fclose(mFile);
+	}
+}
+
+TextEditor::UndoArena::Text TextEditor::UndoArena::Allocate(size_t aLength, char*& aData)
+{
+	if (mBlocks.empty() || mBlocks.back().mData.capacity() - mBlocks.back().mSize < aLength)
+	{
+		// The previous block is full, it can go as soon as its texts are released
+		if (!mBlocks.empty() && mBlocks.back().mTexts == 0)
+		{
+			mMemory -= mBlocks.back().mData.capacity();
+			std::vector<char, Allocator<char>>().swap(mBlocks.back().mData);
+		}
+
+		mBlocks.emplace_back();
+		mBlocks.back().mData.reserve(std::max(aLength, sUndoBlockSize));
+		mMemory += mBlocks.back().mData.capacity();
+	}
+
+	auto& block = mBlocks.back();
+	Text text;
+	text.mBlock = mFirstBlock + mBlocks.size() - 1;
+	text.mOffset = block.mSize;
+	text.mLength = aLength;
+
+	block.mSize += aLength;
+	block.mData.resize(block.mSize);
+	block.mTextSize += aLength;
+	mTextSize += aLength;
+	++block.mTexts;
+	aData = &block.mData[text.mOffset];
+	return text;
+}
+
+TextEditor::UndoArena::Text TextEditor::UndoArena::Append(const std::string& aText)
+{
+	if (aText.empty())
+	{
+		return Text();
+	}
+
+	char* data;
+	auto text = Allocate(aText.size(), data);
+	memcpy(data, aText.data(), aText.size());
+	Spill();
+	return text;
+}
+
+TextEditor::UndoArena::Text TextEditor::UndoArena::Append(const Text& aText, const std::string& aSuffix)
+{
+	if (aText.IsEmpty())
+	{
+		return Append(aSuffix);
+	}
+
+	// Typing extends the last text of the last block, which is always in memory
+	auto& block = GetBlock(aText.mBlock);
+	if (&block == &mBlocks.back() && aText.mOffset + aText.mLength == block.mSize && block.mData.capacity() - block.mSize >= aSuffix.size())
+	{
+		block.mData.insert(block.mData.end(), aSuffix.begin(), aSuffix.end());
+		block.mSize += aSuffix.size();
+		block.mTextSize += aSuffix.size();
+		mTextSize += aSuffix.size();
+
+		auto text = aText;
+		text.mLength += aSuffix.size();
+		return text;
+	}
+
+	std::string joined;
+	Read(aText, joined);
+	joined += aSuffix;
+	Release(aText);
+	return Append(joined);
+}
+
+TextEditor::UndoArena::Text TextEditor::UndoArena::Prepend(const std::string& aPrefix, const Text& aText)
+{
+	std::string joined;
+	Read(aText, joined);
+	joined.insert(0, aPrefix);
+	Release(aText);
+	return Append(joined);
+}
+
+void TextEditor::UndoArena::Release(const Text& aText)
+{
+	if (aText.IsEmpty())
+	{
+		return;
+	}
+
+	auto& block = GetBlock(aText.mBlock);
+	block.mTextSize -= aText.mLength;
+	mTextSize -= block.mSpilled ? 0 : aText.mLength;
+	if (--block.mTexts == 0 && &block != &mBlocks.back())
+	{
+		if (block.mSpilled)
+		{
+			--mSpilledBlocks;
+		}
+		else
+		{
+			mMemory -= block.mData.capacity();
+			std::vector<char, Allocator<char>>().swap(block.mData);
+		}
+	}
+
+	while (mBlocks.size() > 1 && mBlocks.front().mTexts == 0)
+	{
+		mBlocks.pop_front();
+		++mFirstBlock;
+		mFirstInMemory -= mFirstInMemory > 0 ? 1 : 0;
+	}
+
+	// Once nothing refers to the file anymore, it is overwritten from its start
+	if (mSpilledBlocks == 0)
+	{
+		mFileSize = 0;
+	}
+}
+
+void TextEditor::UndoArena::Read(const Text& aText, std::string& aResult)
 {
-	if (!mAdded.empty())
+	auto& block = GetBlock(aText.mBlock);
+	if (!block.mSpilled)
 	{
-		aEditor->DeleteRange(mAddedStart, mAddedEnd);
-		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 2);
+		aResult.assign(&block.mData[aText.mOffset], aText.mLength);
+		return;
 	}
 
-	if (!mRemoved.empty())
+	aResult.resize(aText.mLength);
+	std::fseek(mFile, (long)(block.mFileOffset + aText.mOffset), SEEK_SET);
+	if (std::fread(&aResult[0], 1, aText.mLength, mFile) != aText.mLength)
 	{
-		auto start = mRemovedStart;
-		aEditor->InsertTextAt(start, mRemoved.c_str());
-		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 2);
+		aResult.clear();
 	}
-
-	aEditor->mState = mBefore;
-	aEditor->EnsureCursorVisible();
 }
 
-void TextEditor::UndoRecord::Redo(TextEditor * aEditor)
+char TextEditor::UndoArena::GetChar(const Text& aText, size_t aIndex)
 {
-	if (!mRemoved.empty())
+	auto& block = GetBlock(aText.mBlock);
+	if (!block.mSpilled)
 	{
-		aEditor->DeleteRange(mRemovedStart, mRemovedEnd);
-		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 1);
+		return block.mData[aText.mOffset + aIndex];
 	}
 
-	if (!mAdded.empty())
+	char result = '\0';
+	std::fseek(mFile, (long)(block.mFileOffset + aText.mOffset + aIndex), SEEK_SET);
+	return std::fread(&result, 1, 1, mFile) == 1 ? result : '\0';
+}
+
+void TextEditor::UndoArena::Clear()
+{
+	mFirstBlock += mBlocks.size();
+	mBlocks.clear();
+	mFirstInMemory = 0;
+	mMemory = 0;
+	mTextSize = 0;
+	mSpilledBlocks = 0;
+	mFileSize = 0;
+}
+
+void TextEditor::UndoArena::SetSpillThreshold(size_t aBytes)
+{
+	mSpillThreshold = aBytes;
+	Spill();
+}
+
+void TextEditor::UndoArena::Spill()
+{
+	// The last block is still being appended to, so it is never spilled
+	while (mMemory > mSpillThreshold && mFirstInMemory + 1 < mBlocks.size())
 	{
-		auto start = mAddedStart;
-		aEditor->InsertTextAt(start, mAdded.c_str());
-		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 1);
-	}
+		auto& block = mBlocks[mFirstInMemory];
+		if (block.mSpilled || block.mTexts == 0)
+		{
+			++mFirstInMemory;
+			continue;
+		}
 
-	aEditor->mState = mAfter;
-	aEditor->EnsureCursorVisible();
+		if (mFile == nullptr)
+		{
+			mFile = std::tmpfile();
+		}
+
+		if (mFile == nullptr || std::fseek(mFile, (long)mFileSize, SEEK_SET) != 0 ||
+			std::fwrite(block.mData.data(), 1, block.mSize, mFile) != block.mSize)
+		{
+			// Without a usable temporary file everything stays in memory
+			mSpillThreshold = std::numeric_limits<size_t>::max();
+			return;
+		}
+
+		block.mFileOffset = mFileSize;
+		block.mSpilled = true;
+		mFileSize += block.mSize;
+		++mSpilledBlocks;
+		mMemory -= block.mData.capacity();
+		mTextSize -= block.mTextSize;
+		std::vector<char, Allocator<char>>().swap(block.mData);
+		++mFirstInMemory;
+	}
 }
 
 const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::HLSL()
@@ -3267,3 +7135,459 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::GLSL()
 
 	return langDef;
 }
+
+void TextEditor::DiagnosticIndex::Reset(Diagnostics&& aDiagnostics)
+{
+	mDiagnostics = std::move(aDiagnostics);
+	std::sort(mDiagnostics.begin(), mDiagnostics.end(), [](const Diagnostic& a, const Diagnostic& b) { return a.mStart < b.mStart; });
+	for (auto& diagnostic : mDiagnostics)
+	{
+		if (diagnostic.mEnd < diagnostic.mStart)
+		{
+			diagnostic.mEnd = diagnostic.mStart;
+		}
+	}
+
+	mShifts.clear();
+	mLastLines.resize(mDiagnostics.size());
+	Build(0, (int)mDiagnostics.size());
+	++mRevision;
+}
+
+void TextEditor::DiagnosticIndex::InsertLines(int aIndex, int aCount)
+{
+	if (mDiagnostics.empty())
+	{
+		return;
+	}
+
+	// Consecutive insertions into the same block, e.g. pasting several lines, are a single shift
+	if (!mShifts.empty() && mShifts.back().mCount > 0 && aIndex >= mShifts.back().mLine && aIndex <= mShifts.back().mLine + mShifts.back().mCount)
+	{
+		mShifts.back().mCount += aCount;
+	}
+	else
+	{
+		mShifts.push_back({ aIndex, aCount });
+	}
+
+	++mRevision;
+}
+
+void TextEditor::DiagnosticIndex::RemoveLines(int aStart, int aEnd)
+{
+	if (mDiagnostics.empty() || aEnd <= aStart)
+	{
+		return;
+	}
+
+	mShifts.push_back({ aStart, aStart - aEnd });
+	++mRevision;
+}
+
+void TextEditor::DiagnosticIndex::MoveLines(int aFirst, const LineOrder& aOrder)
+{
+	if (mDiagnostics.empty())
+	{
+		return;
+	}
+
+	// A diagnostic starting in the moved lines goes with its start line, so it keeps its length
+	ApplyShifts();
+	const int count = (int)aOrder.size();
+	std::vector<int> moved(count);
+	for (int i = 0; i < count; ++i)
+	{
+		moved[aOrder[i]] = i;
+	}
+
+	for (auto& diagnostic : mDiagnostics)
+	{
+		const int line = diagnostic.mStart.mLine;
+		if (line >= aFirst && line < aFirst + count)
+		{
+			const int delta = moved[line - aFirst] + aFirst - line;
+			diagnostic.mStart.mLine += delta;
+			diagnostic.mEnd.mLine += delta;
+		}
+	}
+
+	std::stable_sort(mDiagnostics.begin(), mDiagnostics.end(), [](const Diagnostic& a, const Diagnostic& b) { return a.mStart < b.mStart; });
+	mLastLines.resize(mDiagnostics.size());
+	Build(0, (int)mDiagnostics.size());
+	++mRevision;
+}
+
+const TextEditor::Diagnostics& TextEditor::DiagnosticIndex::GetDiagnostics()
+{
+	ApplyShifts();
+	return mDiagnostics;
+}
+
+void TextEditor::DiagnosticIndex::ApplyShifts()
+{
+	if (mShifts.empty())
+	{
+		return;
+	}
+
+	// Shifting keeps the order by start line, so only the tree needs to be rebuilt
+	for (auto& shift : mShifts)
+	{
+		if (shift.mCount > 0)
+		{
+			for (auto& diagnostic : mDiagnostics)
+			{
+				if (diagnostic.mStart.mLine >= shift.mLine)
+				{
+					diagnostic.mStart.mLine += shift.mCount;
+				}
+
+				if (diagnostic.mEnd.mLine >= shift.mLine)
+				{
+					diagnostic.mEnd.mLine += shift.mCount;
+				}
+			}
+		}
+		else
+		{
+			// Diagnostics inside the removed lines are dropped, the others are cut to the remaining lines
+			const int start = shift.mLine;
+			const int end = shift.mLine - shift.mCount;
+			auto removed = [start, end](const Diagnostic& aDiagnostic)
+			{
+				return aDiagnostic.mStart.mLine >= start && aDiagnostic.mEnd.mLine < end;
+			};
+
+			mDiagnostics.erase(std::remove_if(mDiagnostics.begin(), mDiagnostics.end(), removed), mDiagnostics.end());
+			for (auto& diagnostic : mDiagnostics)
+			{
+				if (diagnostic.mStart.mLine >= end)
+				{
+					diagnostic.mStart.mLine += shift.mCount;
+				}
+				else if (diagnostic.mStart.mLine >= start)
+				{
+					diagnostic.mStart = Coordinates(start, 0);
+				}
+
+				if (diagnostic.mEnd.mLine >= end)
+				{
+					diagnostic.mEnd.mLine += shift.mCount;
+				}
+				else if (diagnostic.mEnd.mLine >= start)
+				{
+					diagnostic.mEnd = Coordinates(start - 1, std::numeric_limits<int>::max());
+				}
+			}
+		}
+	}
+
+	mShifts.clear();
+	mLastLines.resize(mDiagnostics.size());
+	Build(0, (int)mDiagnostics.size());
+}
+
+int TextEditor::DiagnosticIndex::Build(int aBegin, int aEnd)
+{
+	if (aBegin >= aEnd)
+	{
+		return -1;
+	}
+
+	const int middle = aBegin + (aEnd - aBegin) / 2;
+	const int lastLine = std::max(mDiagnostics[middle].mEnd.mLine, std::max(Build(aBegin, middle), Build(middle + 1, aEnd)));
+	mLastLines[middle] = lastLine;
+	return lastLine;
+}
+
+template <class Visitor>
+void TextEditor::DiagnosticIndex::Visit(int aFirstLine, int aLastLine, Visitor aVisitor)
+{
+	ApplyShifts();
+	Visit(0, (int)mDiagnostics.size(), aFirstLine, aLastLine, aVisitor);
+}
+
+template <class Visitor>
+void TextEditor::DiagnosticIndex::Visit(int aBegin, int aEnd, int aFirstLine, int aLastLine, Visitor& aVisitor)
+{
+	while (aBegin < aEnd)
+	{
+		const int middle = aBegin + (aEnd - aBegin) / 2;
+		if (mLastLines[middle] < aFirstLine)
+		{
+			return;
+		}
+
+		Visit(aBegin, middle, aFirstLine, aLastLine, aVisitor);
+
+		auto& diagnostic = mDiagnostics[middle];
+		if (diagnostic.mStart.mLine > aLastLine)
+		{
+			return;
+		}
+
+		if (diagnostic.mEnd.mLine >= aFirstLine)
+		{
+			aVisitor(diagnostic);
+		}
+
+		aBegin = middle + 1;
+	}
+}
+
+void TextEditor::SetDiagnostics(Diagnostics aDiagnostics)
+{
+	mDiagnostics.Reset(std::move(aDiagnostics));
+}
+
+const TextEditor::Diagnostic* TextEditor::GetDiagnosticAt(const Coordinates& aPosition) const
+{
+	const Diagnostic* result = nullptr;
+	mDiagnostics.Visit(aPosition.mLine, aPosition.mLine, [&](const Diagnostic& aDiagnostic)
+	{
+		const bool covered = aDiagnostic.mStart <= aPosition && (aPosition < aDiagnostic.mEnd || aPosition == aDiagnostic.mStart);
+		if (covered && (result == nullptr || aDiagnostic.mSeverity < result->mSeverity))
+		{
+			result = &aDiagnostic;
+		}
+	});
+
+	return result;
+}
+
+void TextEditor::RenderDiagnostics(ImDrawList* aDrawList, float aLeft, int aFirstLine, int aLastLine, float aMinX, float aMaxX)
+{
+	mDiagnostics.Visit(aFirstLine, aLastLine, [&](const Diagnostic& aDiagnostic)
+	{
+		const auto color = mPalette[(int)PaletteIndex::DiagnosticError + (int)aDiagnostic.mSeverity];
+		const int first = std::max(aFirstLine, aDiagnostic.mStart.mLine);
+		const int last = std::min(aLastLine, aDiagnostic.mEnd.mLine);
+		for (int line = first; line <= last; ++line)
+		{
+			float x1 = line == aDiagnostic.mStart.mLine ? TextDistanceToLineStart(aDiagnostic.mStart) : 0.0f;
+			float x2 = line == aDiagnostic.mEnd.mLine ? TextDistanceToLineStart(aDiagnostic.mEnd) : GetLineLayout(line).mOffsets.back();
+			if (x2 <= x1)
+			{
+				x2 = x1 + mCharAdvance.x; // Empty ranges mark the character at their start
+			}
+
+			// A zigzag of 2 pixel steps, aligned to the text start so that it does not move while scrolling horizontally
+			x1 = std::max(x1, floorf(aMinX * 0.5f) * 2.0f);
+			x2 = std::min(x2, aMaxX);
+			const float y = GetLineScreenY(line) + mCharAdvance.y - 1.5f;
+			for (int step = (int)(x1 * 0.5f); step * 2.0f < x2; ++step)
+			{
+				const float x = aLeft + step * 2.0f;
+				aDrawList->AddLine(ImVec2(x, y - (step & 1) * 1.5f), ImVec2(x + 2.0f, y - (~step & 1) * 1.5f), color);
+			}
+		}
+	});
+}
+
+// Runs the provider on its own thread, on the latest snapshot handed to it
+struct TextEditor::DiagnosticsWorker
+{
+	explicit DiagnosticsWorker(DiagnosticsProvider* aProvider)
+		: mProvider(aProvider)
+		, mQuit(false)
+		, mHasSnapshot(false)
+		, mHasResult(false)
+		, mLatestVersion(0)
+		, mCancelled(false)
+	{
+		mThread = std::thread(&DiagnosticsWorker::Run, this);
+	}
+
+	~DiagnosticsWorker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mQuit = true;
+			mCancelled = true;
+		}
+
+		mCondition.notify_one();
+		mThread.join();
+	}
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		for (;;)
+		{
+			mCondition.wait(lock, [this] { return mQuit || mHasSnapshot; });
+			if (mQuit)
+			{
+				return;
+			}
+
+			DiagnosticsSnapshot snapshot(std::move(mSnapshot));
+			mHasSnapshot = false;
+			mCancelled = snapshot.mVersion != mLatestVersion;
+			lock.unlock();
+
+			Diagnostics result;
+			if (!mCancelled)
+			{
+				mProvider->Run(snapshot, mCancelled, result);
+			}
+
+			lock.lock();
+			if (!mCancelled && snapshot.mVersion == mLatestVersion)
+			{
+				mResult = std::move(result);
+				mHasResult = true;
+			}
+		}
+	}
+
+	void Post(DiagnosticsSnapshot&& aSnapshot)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mLatestVersion = aSnapshot.mVersion;
+			mSnapshot = std::move(aSnapshot);
+			mHasSnapshot = true;
+			mHasResult = false;
+		}
+
+		mCondition.notify_one();
+	}
+
+	// Makes any run on an older version of the text stop and drop its result
+	void Cancel(uint64_t aVersion)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mLatestVersion = aVersion;
+		mCancelled = true;
+		mHasResult = false;
+	}
+
+	bool TakeResult(Diagnostics& aResult)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mHasResult)
+		{
+			return false;
+		}
+
+		aResult = std::move(mResult);
+		mHasResult = false;
+		return true;
+	}
+
+	DiagnosticsProvider* mProvider;
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	bool mQuit;
+	bool mHasSnapshot;
+	bool mHasResult;
+	uint64_t mLatestVersion;
+	DiagnosticsSnapshot mSnapshot;
+	Diagnostics mResult;
+	std::atomic<bool> mCancelled;
+};
+
+void TextEditor::SetDiagnosticsProvider(DiagnosticsProvider* aProvider, double aDebounce)
+{
+	mDiagnosticsWorker.reset();
+	mDiagnosticsProvider = aProvider;
+	mDiagnosticsDebounce = aDebounce;
+	mDiagnosticsRunning = false;
+	mDiagnosticsDueTime = DBL_MAX;
+
+	if (aProvider != nullptr)
+	{
+		mDiagnosticsWorker.reset(new DiagnosticsWorker(aProvider));
+		mDiagnosticsDueTime = 0.0; // The current text is checked right away
+	}
+}
+
+void TextEditor::UpdateDiagnosticsProvider()
+{
+	if (!mDiagnosticsWorker)
+	{
+		return;
+	}
+
+	const double time = ImGui::GetTime();
+	if (mTextChanged)
+	{
+		++mTextVersion;
+		mDiagnosticsWorker->Cancel(mTextVersion);
+		mDiagnosticsRunning = false;
+		if (mDiagnosticsDueTime != 0.0) // A provider set since the last frame still checks the text right away
+		{
+			mDiagnosticsDueTime = time + mDiagnosticsDebounce;
+		}
+	}
+
+	if (time >= mDiagnosticsDueTime)
+	{
+		DiagnosticsSnapshot snapshot;
+		snapshot.mLines = GetTextLines();
+		snapshot.mTabSize = mTabSize;
+		snapshot.mVersion = mTextVersion;
+		mDiagnosticsWorker->Post(std::move(snapshot));
+		mDiagnosticsDueTime = DBL_MAX;
+		mDiagnosticsRunning = true;
+	}
+
+	// Results only arrive for the current version of the text, so their coordinates are valid as they are
+	Diagnostics result;
+	if (mDiagnosticsRunning && mDiagnosticsWorker->TakeResult(result))
+	{
+		mDiagnosticsRunning = false;
+		SetDiagnostics(std::move(result));
+	}
+}
+
+void TextEditor::RegexDiagnosticsProvider::AddRule(const std::string& aPattern, DiagnosticSeverity aSeverity, const std::string& aMessage)
+{
+	Rule rule;
+	rule.mRegex = std::regex(aPattern, std::regex_constants::optimize);
+	rule.mSeverity = aSeverity;
+	rule.mMessage = aMessage;
+	mRules.push_back(std::move(rule));
+}
+
+// Column of a byte offset, counting UTF-8 sequences as one column and expanding tabs
+static int SnapshotColumn(const std::string& aLine, size_t aOffset, int aTabSize)
+{
+	int column = 0;
+	for (size_t i = 0; i < aOffset && i < aLine.size(); )
+	{
+		auto c = (TextEditor::Char)aLine[i];
+		i += UTF8CharLength(c);
+		column = c == '\t' ? (column / aTabSize) * aTabSize + aTabSize : column + 1;
+	}
+
+	return column;
+}
+
+void TextEditor::RegexDiagnosticsProvider::Run(const DiagnosticsSnapshot& aSnapshot, const std::atomic<bool>& aCancelled, Diagnostics& aResult)
+{
+	for (int line = 0; line < (int)aSnapshot.mLines.size() && !aCancelled; ++line)
+	{
+		auto& text = aSnapshot.mLines[line];
+		for (auto& rule : mRules)
+		{
+			for (std::sregex_iterator it(text.begin(), text.end(), rule.mRegex), end; it != end; ++it)
+			{
+				Diagnostic diagnostic;
+				diagnostic.mStart = Coordinates(line, SnapshotColumn(text, it->position(), aSnapshot.mTabSize));
+				diagnostic.mEnd = Coordinates(line, SnapshotColumn(text, it->position() + it->length(), aSnapshot.mTabSize));
+				diagnostic.mSeverity = rule.mSeverity;
+				diagnostic.mMessage = rule.mMessage;
+				aResult.push_back(std::move(diagnostic));
+
+				if (it->length() == 0)
+				{
+					break;
+				}
+			}
+		}
+	}
+}
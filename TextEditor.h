@@ -1,19 +1,23 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <array>
+#include <cstdio>
+#include <deque>
 #include <memory>
 #include <unordered_set>
 #include <unordered_map>
 #include <map>
+#include <new>
 #include <regex>
 #include "imgui.h"
 
 class TextEditor
 {
 public:
-	enum class PaletteIndex
+	enum class PaletteIndex : uint8_t
 	{
 		Default,
 		Keyword,
@@ -36,9 +40,19 @@ public:
 		CurrentLineFill,
 		CurrentLineFillInactive,
 		CurrentLineEdge,
+		DiagnosticError,
+		DiagnosticWarning,
+		DiagnosticInfo,
 		Max
 	};
 
+	enum class FontPitch
+	{
+		Auto,		// Fixed if all printable ASCII characters have the same advance
+		Fixed,
+		Variable
+	};
+
 	enum class SelectionMode
 	{
 		Normal,
@@ -46,6 +60,13 @@ public:
 		Line
 	};
 
+	enum class DiagnosticSeverity
+	{
+		Error,
+		Warning,
+		Info
+	};
+
 	struct Breakpoint
 	{
 		int mLine;
@@ -135,6 +156,71 @@ public:
 	typedef std::unordered_set<std::string> Keywords;
 	typedef std::map<int, std::string> ErrorMarkers;
 	typedef std::unordered_set<int> Breakpoints;
+
+	// Replaces the text from mStart to mEnd with mText, see ApplyEdits()
+	struct TextEdit
+	{
+		TextEdit() {}
+		TextEdit(const Coordinates& aStart, const Coordinates& aEnd, const std::string& aText)
+			: mStart(aStart), mEnd(aEnd), mText(aText) {}
+
+		Coordinates mStart;
+		Coordinates mEnd;
+		std::string mText;
+	};
+
+	typedef std::vector<TextEdit> TextEdits;
+
+	// A column range of the text with a message, e.g. a compiler warning. Coordinates are 0-based.
+	struct Diagnostic
+	{
+		Diagnostic() : mSeverity(DiagnosticSeverity::Error) {}
+
+		Coordinates mStart;
+		Coordinates mEnd;
+		DiagnosticSeverity mSeverity;
+		std::string mMessage;
+	};
+
+	typedef std::vector<Diagnostic> Diagnostics;
+
+	// The text handed to a DiagnosticsProvider, one string per line
+	struct DiagnosticsSnapshot
+	{
+		DiagnosticsSnapshot() : mTabSize(4), mVersion(0) {}
+
+		std::vector<std::string> mLines;
+		int mTabSize; // For converting byte offsets to columns
+		uint64_t mVersion;
+	};
+
+	// Computes diagnostics on a worker thread of the editor. A run is cancelled as soon as the text is edited again;
+	// long running providers should check aCancelled and return early, since their result is discarded anyway.
+	class DiagnosticsProvider
+	{
+	public:
+		virtual ~DiagnosticsProvider() {}
+		virtual void Run(const DiagnosticsSnapshot& aSnapshot, const std::atomic<bool>& aCancelled, Diagnostics& aResult) = 0;
+	};
+
+	// Reports every match of a regular expression, e.g. for TODO comments or as a stand-in for a real checker.
+	// Rules have to be added before the provider is handed to an editor.
+	class RegexDiagnosticsProvider : public DiagnosticsProvider
+	{
+	public:
+		void AddRule(const std::string& aPattern, DiagnosticSeverity aSeverity, const std::string& aMessage);
+		void Run(const DiagnosticsSnapshot& aSnapshot, const std::atomic<bool>& aCancelled, Diagnostics& aResult) override;
+
+	private:
+		struct Rule
+		{
+			std::regex mRegex;
+			DiagnosticSeverity mSeverity;
+			std::string mMessage;
+		};
+
+		std::vector<Rule> mRules;
+	};
 	typedef std::array<ImU32, (unsigned)PaletteIndex::Max> Palette;
 	typedef uint8_t Char;
 
@@ -154,8 +240,64 @@ public:
 			, mPreprocessor(false) {}
 	};
 
-	typedef std::vector<Glyph> Line;
-	typedef std::vector<Line> Lines;
+	// Allocation hooks for the editor's lines, caches and scratch buffers, like ImGui::SetAllocatorFunctions().
+	// Set them before creating any editor. Every allocation made through them is counted, e.g. to check that
+	// a frame without edits does not allocate. Not counted are std::string members (the word under the mouse,
+	// the undo texts being built, the text of an insert in progress), std::regex internals, the language
+	// definition and the diagnostics worker; a complete check also has to count the global operator new.
+	typedef void* (*AllocateCallback)(size_t aSize, void* aUserData);
+	typedef void (*FreeCallback)(void* aPtr, void* aUserData);
+	static void SetAllocatorFunctions(AllocateCallback aAllocate, FreeCallback aFree, void* aUserData = nullptr);
+	static void* MemAlloc(size_t aSize);
+	static void MemFree(void* aPtr);
+	static uint64_t GetAllocationCount(); // Since the start of the program
+	static int GetActiveAllocationCount();
+
+	template <class T>
+	struct Allocator
+	{
+		typedef T value_type;
+
+		Allocator() {}
+		template <class U> Allocator(const Allocator<U>&) {}
+
+		T* allocate(size_t aCount)
+		{
+			auto ptr = MemAlloc(aCount * sizeof(T));
+			if (ptr == nullptr)
+			{
+				throw std::bad_alloc();
+			}
+
+			return static_cast<T*>(ptr);
+		}
+
+		void deallocate(T* aPtr, size_t) { MemFree(aPtr); }
+
+		template <class U> bool operator==(const Allocator<U>&) const { return true; }
+		template <class U> bool operator!=(const Allocator<U>&) const { return false; }
+	};
+
+	// A line of glyphs. Its revision identifies the content: it is renewed every time
+	// the glyphs change, so anything cached per revision can never go stale.
+	class Line : public std::vector<Glyph, Allocator<Glyph>>
+	{
+	public:
+		Line() : mRevision(NewRevision()), mMarkerSlot(0) {}
+
+		uint64_t GetRevision() const { return mRevision; }
+		void Touch() { mRevision = NewRevision(); }
+
+	private:
+		friend class TextEditor;
+
+		static uint64_t NewRevision();
+
+		uint64_t mRevision;
+		uint32_t mMarkerSlot; // Markers of the line in TextEditor::mMarkerSlots, 0 if it has none
+	};
+
+	typedef std::vector<Line, Allocator<Line>> Lines;
 
 	struct LanguageDefinition
 	{
@@ -191,11 +333,47 @@ public:
 	void SetLanguageDefinition(const LanguageDefinition& aLanguageDef);
 	const LanguageDefinition& GetLanguageDefinition() const { return mLanguageDefinition; }
 
+	// Diagnostic colors left zero fall back to those of GetColorPalette()
 	const Palette& GetPalette() const { return mPaletteBase; }
 	void SetPalette(const Palette& aValue);
 
-	void SetErrorMarkers(const ErrorMarkers& aMarkers) { mErrorMarkers = aMarkers; }
-	void SetBreakpoints(const Breakpoints& aMarkers) { mBreakpoints = aMarkers; }
+	// Markers are anchored to their lines and move along with them when lines are inserted or removed.
+	// Line numbers are 1-based, like the keys of ErrorMarkers. Markers of lines past the end of the text, e.g. set
+	// before SetText(), keep their line numbers until the text has those lines.
+	void SetErrorMarkers(const ErrorMarkers& aMarkers);
+	void AddErrorMarker(int aLine, const std::string& aMessage);
+	void RemoveErrorMarker(int aLine);
+	ErrorMarkers GetErrorMarkers() const;
+
+	void SetBreakpoints(const Breakpoints& aMarkers);
+	void AddBreakpoint(int aLine);
+	void RemoveBreakpoint(int aLine);
+	bool HasBreakpoint(int aLine) const;
+	Breakpoints GetBreakpoints() const;
+
+	void AddBookmark(int aLine);
+	void RemoveBookmark(int aLine);
+	bool HasBookmark(int aLine) const;
+	std::vector<int> GetBookmarks() const;
+
+	// Diagnostics are underlined with a squiggle and shown in a tooltip on hover. They move along with their lines
+	// when lines are inserted or removed. SetDiagnostics replaces all of them at once, e.g. after a compiler run.
+	void SetDiagnostics(Diagnostics aDiagnostics);
+	void ClearDiagnostics() { SetDiagnostics(Diagnostics()); }
+	const Diagnostics& GetDiagnostics() const { return mDiagnostics.GetDiagnostics(); }
+	const Diagnostic* GetDiagnosticAt(const Coordinates& aPosition) const; // The most severe one, nullptr if there is none
+
+	// Runs the provider on a snapshot of the text once it was left unchanged for aDebounce seconds. The results
+	// replace the diagnostics at the beginning of a later Render(), unless the text changed in the meantime.
+	// The provider is not owned and has to outlive the editor, or be replaced by nullptr first.
+	void SetDiagnosticsProvider(DiagnosticsProvider* aProvider, double aDebounce = 0.5);
+	DiagnosticsProvider* GetDiagnosticsProvider() const { return mDiagnosticsProvider; }
+
+	// Extra gutter columns, drawn from left to right before the line numbers, e.g. for markers, fold arrows or
+	// change bars. The callback draws the cell of one visible line (aLine is 0-based) into the draw list.
+	typedef void(*GutterCallback)(ImDrawList* aDrawList, const ImVec2& aMin, const ImVec2& aMax, int aLine, void* aUserData);
+	void AddGutterColumn(float aWidth, GutterCallback aCallback, void* aUserData = nullptr);
+	void ClearGutterColumns();
 
 	void Render(const char* aTitle, const ImVec2& aSize = ImVec2(), bool aBorder = false);
 	void SetText(const std::string& aText);
@@ -211,10 +389,18 @@ public:
 	bool IsOverwrite() const { return mOverwrite; }
 
 	void SetReadOnly(bool aValue);
-	bool IsReadOnly() const { return mReadOnly; }
+	bool IsReadOnly() const { return mReadOnly || IsInserting(); } // Also while a large insert is in progress
 	bool IsTextChanged() const { return mTextChanged; }
 	bool IsCursorPositionChanged() const { return mCursorPositionChanged; }
 
+	// Idle detection for hosts that only render on demand. IsRedrawNeeded() tells whether the editor changed
+	// or has pending work (colorization, scrolling) since its last Render(), GetNextRedrawTime() returns the
+	// ImGui::GetTime() at which it needs a frame (DBL_MAX when idle, e.g. no blinking cursor), and
+	// IsLastFrameUnchanged() tells whether the last Render() drew exactly what the one before it drew.
+	bool IsRedrawNeeded() const;
+	double GetNextRedrawTime() const;
+	bool IsLastFrameUnchanged() const { return mFrameUnchanged; }
+
 	bool IsColorizerEnabled() const { return mColorizerEnabled; }
 	void SetColorizerEnable(bool aValue);
 
@@ -236,9 +422,40 @@ public:
 	void SetTabSize(int aValue);
 	inline int GetTabSize() const { return mTabSize; }
 
+	// With a fixed-pitch font, layout and hit testing of lines without non-ASCII characters are computed from
+	// column numbers alone
+	inline void SetFontPitch(FontPitch aValue) { mFontPitch = aValue; }
+	inline FontPitch GetFontPitch() const { return mFontPitch; }
+	inline bool IsFixedPitch() const { return mFixedPitch; }
+
+	// Glyph advances are cached per font and size. Call this after rebuilding the font atlas, since a rebuilt
+	// font may have other advances at the same address.
+	static void InvalidateFontCaches() { GlyphAdvanceCache::Invalidate(); }
+
+	// Lines longer than this many bytes are only laid out and drawn up to the limit, followed by
+	// an indicator. Zero (the default) means no limit.
+	void SetLineLengthLimit(int aValue);
+	inline int GetLineLengthLimit() const { return mLineLengthLimit; }
+
+	// Inserts at the cursor, as an undo step of its own or as part of the edit in progress, see BeginEdit().
+	// Does nothing in a read-only editor.
 	void InsertText(const std::string& aValue);
 	void InsertText(const char* aValue);
 
+	// Applies edits given in any order, with coordinates into the text before any of them, as a single undo step.
+	// Insertions at the same place keep the order of aEdits; an edit overlapping the one after it is left out.
+	// Cursors and markers move along with the text around them, and only the lines edited are colorized again.
+	void ApplyEdits(const TextEdits& aEdits);
+
+	// Text longer than this many bytes, pasted or given to InsertText(), goes in over several frames, up to about
+	// this many bytes in each Render(). The editor is read-only meanwhile, and the paste is undone in one step.
+	// Zero (the default) inserts any text at once.
+	inline void SetInsertChunkSize(size_t aValue) { mInsertChunkSize = aValue; }
+	inline size_t GetInsertChunkSize() const { return mInsertChunkSize; }
+	bool IsInserting() const { return !mInsertText.empty(); }
+	float GetInsertProgress() const; // From 0 to 1, of the insert in progress
+	void FinishInsert(); // Inserts the rest of the text in progress at once
+
 	void MoveUp(int aAmount = 1, bool aSelect = false);
 	void MoveDown(int aAmount = 1, bool aSelect = false);
 	void MoveLeft(int aAmount = 1, bool aSelect = false, bool aWordMode = false);
@@ -255,6 +472,41 @@ public:
 	void SelectAll();
 	bool HasSelection() const;
 
+	// Extra cursors, each with its own selection, besides the one the functions above work on. Editing and
+	// moving is done at every cursor, edits in one pass from the bottom up, recorded as a single undo step.
+	// The shortcuts for AddCursorForNextOccurrence() and SplitSelectionIntoLines() need ImGui 1.87 or later.
+	void AddCursor(const Coordinates& aPosition);
+	void AddCursorAbove();
+	void AddCursorBelow();
+	void AddCursorForNextOccurrence(); // Selects the word under the cursor first if nothing is selected
+	void SplitSelectionIntoLines();
+	void ClearExtraCursors();
+	int GetCursorCount() const { return 1 + (int)mExtraCursors.size(); }
+
+	// Operations on whole lines: those of every cursor and its selection, leaving out the last line of a selection
+	// that ends at its start. Each call is a single undo step. The shortcuts for DeleteLines(), ToggleLineComment(),
+	// IndentLines() and UnindentLines() need ImGui 1.87 or later.
+	void MoveLinesUp();
+	void MoveLinesDown();
+	void DuplicateLines();
+	void DeleteLines();
+	void SortLines(bool aUnique = false); // By bytes, so UTF-8 sorts by code point; aUnique drops repeated lines
+	void ToggleLineComment(); // With the single line comment of the language definition
+	void IndentLines();
+	void UnindentLines();
+
+	// Literal search through the whole text for what SetFindText() is given, with the case of ASCII letters ignored
+	// unless aMatchCase is set. The matches are found in order, without overlapping, and kept up to date as the text
+	// changes. FindNextMatch() and FindPreviousMatch() select the match after or before the cursor, wrapping around.
+	void SetFindText(const std::string& aText, bool aMatchCase = true);
+	inline const std::string& GetFindText() const { return mFindText; }
+	inline bool IsFindMatchCase() const { return mFindMatchCase; }
+	int GetFindMatchCount() const;
+	bool GetFindMatch(int aIndex, Coordinates& aStart, Coordinates& aEnd) const;
+	int GetFindMatchIndex() const; // Of the match that is selected, -1 if none is
+	bool FindNextMatch();
+	bool FindPreviousMatch();
+
 	void Copy();
 	void Cut();
 	void Paste();
@@ -265,6 +517,49 @@ public:
 	void Undo(int aSteps = 1);
 	void Redo(int aSteps = 1);
 
+	// Edits made between BeginEdit() and the matching EndEdit() are undone in one step, and scrolling to the cursor
+	// is left until the end. Calls can be nested; undo and redo are not available until the outermost one ends.
+	void BeginEdit();
+	void EndEdit();
+	bool IsEditing() const { return mEditDepth > 0; }
+
+	// Calls BeginEdit() and EndEdit() for the lifetime of the scope
+	class EditScope
+	{
+	public:
+		explicit EditScope(TextEditor& aEditor) : mEditor(aEditor) { mEditor.BeginEdit(); }
+		~EditScope() { mEditor.EndEdit(); }
+
+	private:
+		EditScope(const EditScope&);
+		EditScope& operator=(const EditScope&);
+
+		TextEditor& mEditor;
+	};
+
+	// The undo history is a tree: editing after an undo starts a new branch instead of dropping the undone edits,
+	// and Redo() follows the branch that was visited last. Nodes are edits, identified by ids that stay valid until
+	// the node is dropped to keep the history within its memory limit. The id -1 stands for the text before the
+	// oldest edit that is left. Some nodes also keep the whole text, about once replaying the edits since the last
+	// one costs as much as restoring it: a jump far through the tree restores the closest one and replays the rest.
+	// Markers keep their line numbers when a text is restored, as with SetText().
+	int GetUndoNode() const { return mUndoNode; }
+	int GetUndoNodeParent(int aNode) const;
+	double GetUndoNodeTime(int aNode) const; // ImGui::GetTime() of the edit
+	void GetUndoNodes(std::vector<int>& aNodes) const; // Oldest first, so parents come before their children
+	bool JumpToUndoNode(int aNode);
+
+	// Characters typed or deleted in a row are undone in one step, unless more than the merge interval passes
+	// between them or a new word is started. The oldest history is dropped once it takes more than the memory limit.
+	void SetUndoMergeInterval(double aSeconds) { mUndoMergeInterval = aSeconds; }
+	double GetUndoMergeInterval() const { return mUndoMergeInterval; }
+	void SetUndoMemoryLimit(size_t aBytes);
+	size_t GetUndoMemoryLimit() const { return mUndoMemoryLimit; }
+	size_t GetUndoMemoryUsage() const { return mUndoMemory + mUndoArena.GetTextSize(); } // Without the text spilled to disk
+
+	// The text of older undo records is moved to a temporary file once more than this is held in memory
+	void SetUndoSpillThreshold(size_t aBytes) { mUndoArena.SetSpillThreshold(aBytes); }
+
 	static const Palette& GetColorPalette();
 
 private:
@@ -272,16 +567,149 @@ private:
 
 	struct EditorState
 	{
+		// Without a selection, its ends may still be wherever it was last; this puts them at the cursor
+		void CollapseEmptySelection()
+		{
+			if (!(mSelectionStart < mSelectionEnd))
+			{
+				mSelectionStart = mSelectionEnd = mCursorPosition;
+			}
+		}
+
 		Coordinates mSelectionStart;
 		Coordinates mSelectionEnd;
 		Coordinates mCursorPosition;
 	};
 
-	class UndoRecord
+	// Text of the undo records, appended to blocks that are written to a temporary file, oldest first, once more
+	// than the spill threshold is held in memory. A block is freed when no text refers to it anymore.
+	class UndoArena
 	{
 	public:
-		UndoRecord() {}
-		~UndoRecord() {}
+		struct Text
+		{
+			Text() : mBlock(0), mOffset(0), mLength(0) {}
+
+			bool IsEmpty() const { return mLength == 0; }
+
+			uint64_t mBlock; // Serial number of the block
+			size_t mOffset;
+			size_t mLength;
+		};
+
+		UndoArena();
+		~UndoArena();
+
+		Text Append(const std::string& aText);
+		Text Append(const Text& aText, const std::string& aSuffix); // Extends the text in place when it is the last one
+		Text Prepend(const std::string& aPrefix, const Text& aText);
+		void Release(const Text& aText);
+		void Read(const Text& aText, std::string& aResult);
+		char GetChar(const Text& aText, size_t aIndex);
+		void Clear();
+		size_t GetMemory() const { return mMemory; } // Of the blocks in memory, whole
+		size_t GetTextSize() const { return mTextSize; } // Of the texts in memory, without the unused rest of their blocks
+		void SetSpillThreshold(size_t aBytes);
+
+	private:
+		struct Block
+		{
+			Block() : mFileOffset(0), mSize(0), mTextSize(0), mTexts(0), mSpilled(false) {}
+
+			std::vector<char, Allocator<char>> mData; // Empty once spilled or released
+			uint64_t mFileOffset;
+			size_t mSize;
+			size_t mTextSize; // Of the texts referring to the block
+			int mTexts; // Texts referring to the block
+			bool mSpilled;
+		};
+
+		UndoArena(const UndoArena&);
+		UndoArena& operator=(const UndoArena&);
+
+		Block& GetBlock(uint64_t aSerial) { return mBlocks[(size_t)(aSerial - mFirstBlock)]; }
+		Text Allocate(size_t aLength, char*& aData);
+		void Spill();
+
+		std::deque<Block, Allocator<Block>> mBlocks;
+		uint64_t mFirstBlock; // Serial number of mBlocks.front()
+		size_t mFirstInMemory; // Index of the oldest block that may still be in memory
+		size_t mMemory;
+		size_t mTextSize;
+		size_t mSpillThreshold;
+		int mSpilledBlocks; // Spilled blocks still referred to
+		std::FILE* mFile;
+		uint64_t mFileSize;
+	};
+
+	// Edits that the next edit of the same kind can be merged into, see MergeUndo()
+	enum class UndoKind : char
+	{
+		Other,
+		Typing,
+		Backspace,
+		Delete
+	};
+
+	// Order of a block of lines after they were moved: the line at index i of the block is the one that was at aOrder[i]
+	typedef std::vector<int, Allocator<int>> LineOrder;
+
+	// Text replaced at one place, or lines moved
+	struct UndoEdit
+	{
+		void Undo(TextEditor* aEditor);
+		void Redo(TextEditor* aEditor);
+		size_t GetMemory() const { return sizeof(UndoEdit) + mAdded.capacity() + mRemoved.capacity() + mMovedOrder.capacity() * sizeof(int); }
+
+		// The text is built in mAdded and mRemoved, and moved into the undo arena by AddUndo()
+		std::string mAdded;
+		UndoArena::Text mAddedText;
+		Coordinates mAddedStart;
+		Coordinates mAddedEnd;
+
+		std::string mRemoved;
+		UndoArena::Text mRemovedText;
+		Coordinates mRemovedStart;
+		Coordinates mRemovedEnd;
+
+		// Set if the texts are whole lines, as many added as removed: they are then replaced line by line, so that
+		// the lines keep their markers, see SetLineTexts()
+		bool mByLine = false;
+
+		// Lines moved instead of text replaced, see ReorderLines()
+		int mMovedFirst = 0;
+		LineOrder mMovedOrder;
+	};
+
+	typedef std::vector<UndoEdit, Allocator<UndoEdit>> UndoEdits;
+	typedef std::vector<EditorState, Allocator<EditorState>> Cursors;
+
+	// Cursor positions as lines and byte indices, moved along by the line operations, see EditLines()
+	typedef std::pair<int, int> LinePosition;
+	struct LinePositions
+	{
+		LinePosition* begin() const { return mBegin; }
+		LinePosition* end() const { return mEnd; }
+
+		LinePosition* mBegin;
+		LinePosition* mEnd;
+	};
+
+	// Where a match of the find text starts and ends, as lines and byte indices
+	struct FindMatch
+	{
+		FindMatch(const LinePosition& aStart, const LinePosition& aEnd) : mStart(aStart), mEnd(aEnd) {}
+
+		LinePosition mStart;
+		LinePosition mEnd;
+	};
+
+	typedef std::vector<FindMatch, Allocator<FindMatch>> FindMatchList;
+
+	class UndoRecord : public UndoEdit
+	{
+	public:
+		UndoRecord() : mKind(UndoKind::Other), mParent(-1), mRedoChild(-1), mTime(0.0), mDropped(false) {}
 
 		UndoRecord(
 			const std::string& aAdded,
@@ -297,27 +725,256 @@ private:
 
 		void Undo(TextEditor* aEditor);
 		void Redo(TextEditor* aEditor);
+		size_t GetReplayCost() const;
+		size_t GetMemory() const
+		{
+			size_t memory = sizeof(UndoRecord) + mAdded.capacity() + mRemoved.capacity() + mMovedOrder.capacity() * sizeof(int) +
+				(mEdits.capacity() - mEdits.size()) * sizeof(UndoEdit) + (mExtraBefore.capacity() + mExtraAfter.capacity()) * sizeof(EditorState);
+			for (auto& edit : mEdits)
+			{
+				memory += edit.GetMemory();
+			}
+
+			return memory;
+		}
 
-		std::string mAdded;
-		Coordinates mAddedStart;
-		Coordinates mAddedEnd;
-
-		std::string mRemoved;
-		Coordinates mRemovedStart;
-		Coordinates mRemovedEnd;
+		UndoEdits mEdits; // Made at the other cursors, in order, after the edit of the record itself
 
 		EditorState mBefore;
 		EditorState mAfter;
+		Cursors mExtraBefore; // Extra cursors, see mExtraCursors
+		Cursors mExtraAfter;
+		UndoKind mKind;
+
+		// Links in the undo tree, by node id
+		int mParent;
+		int mRedoChild; // The child Redo() goes to, -1 if there is none
+		double mTime;
+		bool mDropped; // Waiting to be popped from the front of the undo buffer
+
+		// The whole text after the record, kept every so often so that a jump through the tree does not have to
+		// replay every record on its way, see JumpToUndoNode()
+		UndoArena::Text mCheckpoint;
+		size_t mReplayCost = 0; // Of the records since the closest checkpoint above, this one included
+	};
+
+	typedef std::deque<UndoRecord, Allocator<UndoRecord>> UndoBuffer;
+
+	// Advance widths of UTF-8 sequences for one font at one size. ASCII is kept in a dense table,
+	// everything else is measured on first use. Instances are shared by the editors using them, see Get(),
+	// and freed with the last one.
+	class GlyphAdvanceCache
+	{
+	public:
+		GlyphAdvanceCache(const ImFont* aFont, float aFontSize);
+
+		static std::shared_ptr<const GlyphAdvanceCache> Get(const ImFont* aFont, float aFontSize);
+		static void Invalidate();
+
+		float GetAdvance(const Glyph* aSequence, int aLength) const;
+		float GetSpaceSize() const { return mAscii[' ']; }
+		float GetNextTabStop(float aX, int aTabSize) const;
+		bool IsFixedPitch() const { return mFixedPitch; }
+
+	private:
+		typedef std::pair<const ImFont*, float> Key;
+		typedef std::map<Key, std::weak_ptr<const GlyphAdvanceCache>, std::less<Key>,
+			Allocator<std::pair<const Key, std::weak_ptr<const GlyphAdvanceCache>>>> Registry;
+
+		static Registry& GetRegistry();
+		float Measure(const char* aText) const;
+
+		const ImFont* mFont;
+		float mFontSize;
+		bool mFixedPitch;
+		float mAscii[128];
+		mutable std::unordered_map<uint64_t, float, std::hash<uint64_t>, std::equal_to<uint64_t>,
+			Allocator<std::pair<const uint64_t, float>>> mOther;
+	};
+
+	// Glyph boundaries of one line, for one font and tab size. Boundary k is the start of the k-th
+	// glyph (the last one is the end of the line); columns and x offsets are both ascending.
+	// Lines longer than the line length limit only get boundaries up to the limit.
+	struct LineLayout
+	{
+		const GlyphAdvanceCache* mAdvances;
+		int mTabSize;
+		int mLengthLimit;
+		int mLastUsedFrame;
+		int mMaxColumn; // Of the whole line, even if truncated
+		bool mTruncated;
+		bool mCells; // Only ASCII, so every glyph but a tab covers one cell of a fixed-pitch font
+		std::vector<int, Allocator<int>> mColumns;
+		std::vector<float, Allocator<float>> mOffsets;
 	};
 
-	typedef std::vector<UndoRecord> UndoBuffer;
+	typedef std::unordered_map<uint64_t, LineLayout, std::hash<uint64_t>, std::equal_to<uint64_t>,
+		Allocator<std::pair<const uint64_t, LineLayout>>> LineLayouts;
+
+	// Pre-shaped drawing of one line: visible glyphs with their pen position and color, and whitespace markers,
+	// with x offsets relative to the start of the text. Render() writes the quads of the visible part straight
+	// into the draw list every frame.
+	struct LineDrawing
+	{
+		struct Quad
+		{
+			float mX;
+			ImU32 mColor;
+			ImWchar mCodepoint;
+		};
+
+		struct Whitespace
+		{
+			float mX1, mX2;
+			bool mTab;
+		};
+
+		const GlyphAdvanceCache* mAdvances;
+		int mTabSize;
+		int mLengthLimit;
+		bool mFixedPitch;
+		uint64_t mPaletteRevision;
+		int mLastUsedFrame;
+		std::vector<Quad, Allocator<Quad>> mQuads; // Left to right
+		std::vector<Whitespace, Allocator<Whitespace>> mWhitespaces;
+	};
+
+	typedef std::unordered_map<uint64_t, LineDrawing, std::hash<uint64_t>, std::equal_to<uint64_t>,
+		Allocator<std::pair<const uint64_t, LineDrawing>>> LineDrawings;
+
+	// Gutter layout and line number advances, rebuilt only when the font, the columns or the number of digits
+	// of the line count change
+	struct Gutter
+	{
+		struct Column
+		{
+			float mWidth;
+			GutterCallback mCallback;
+			void* mUserData;
+		};
+
+		Gutter() : mAdvances(nullptr), mDigitCount(0), mColumnsChanged(true) {}
+
+		const GlyphAdvanceCache* mAdvances;
+		int mDigitCount;
+		bool mColumnsChanged;
+		float mDigitAdvances[10];
+		std::vector<Column, Allocator<Column>> mColumns;
+	};
+
+	// Markers of one line, kept in a slot referenced by the line
+	struct LineMarkers
+	{
+		LineMarkers() : mBreakpoint(false), mBookmark(false), mError(false) {}
+
+		bool IsEmpty() const { return !mBreakpoint && !mBookmark && !mError; }
+		void Merge(const LineMarkers& aOther);
+
+		bool mBreakpoint;
+		bool mBookmark;
+		bool mError;
+		std::string mErrorMessage;
+	};
+
+	// Widest line of the document, kept as a count of lines per measured width so that an edit only re-measures the
+	// lines it touched. Lines are measured lazily by the editor: the lines an edit marked first, then the rest of the
+	// document from a sweep position that moves down as lines get measured. Inserting or removing lines shifts the
+	// per-line arrays like mLines itself, and otherwise costs O(log n) per removed line and O(1) per inserted line.
+	class LineWidthIndex
+	{
+	public:
+		LineWidthIndex();
+
+		void Reset(int aLines);
+		void InsertLines(int aIndex, int aCount);
+		void RemoveLines(int aStart, int aEnd);
+		void MarkDirty(int aLine);
+		bool PopDirty(int& aLine);
+		bool HasDirtyLines() const { return !mDirty.empty() || mSweep < (int)mWidths.size(); }
+		uint64_t GetRevision(int aLine) const { return mRevisions[aLine]; }
+		void SetWidth(int aLine, uint64_t aRevision, float aWidth);
+		float GetMaxWidth() const;
+
+	private:
+		void AddWidth(float aWidth);
+		void RemoveWidth(float aWidth);
+
+		std::vector<float, Allocator<float>> mWidths;
+		std::vector<uint64_t, Allocator<uint64_t>> mRevisions; // Revision of the line each width was measured at, 0 if not measured yet
+		std::vector<int, Allocator<int>> mDirty; // Lines marked since they were last measured, may repeat
+		std::map<float, int, std::less<float>, Allocator<std::pair<const float, int>>> mWidthCounts; // Lines per non-zero width
+		int mSweep; // Lines from here on have not been measured since the last reset
+	};
+
+	// Diagnostics sorted by start line, searched as an interval tree: the middle element of every range is the root
+	// of that range and stores the last line covered by any diagnostic in it. Line insertions and removals are queued
+	// and applied at the next query, so typing only costs one pass over the diagnostics per frame.
+	class DiagnosticIndex
+	{
+	public:
+		DiagnosticIndex() : mRevision(0) {}
+
+		void Reset(Diagnostics&& aDiagnostics);
+		void InsertLines(int aIndex, int aCount);
+		void RemoveLines(int aStart, int aEnd);
+		void MoveLines(int aFirst, const LineOrder& aOrder);
+		const Diagnostics& GetDiagnostics();
+		bool IsEmpty() const { return mDiagnostics.empty(); }
+		uint64_t GetRevision() const { return mRevision; }
+
+		// Calls aVisitor(const Diagnostic&) for every diagnostic covering any of the lines, ordered by start line
+		template <class Visitor> void Visit(int aFirstLine, int aLastLine, Visitor aVisitor);
+
+	private:
+		struct Shift
+		{
+			int mLine;
+			int mCount; // Lines inserted at mLine if positive, lines removed starting at mLine if negative
+		};
+
+		void ApplyShifts();
+		int Build(int aBegin, int aEnd);
+		template <class Visitor> void Visit(int aBegin, int aEnd, int aFirstLine, int aLastLine, Visitor& aVisitor);
+
+		Diagnostics mDiagnostics;
+		std::vector<int, Allocator<int>> mLastLines;
+		std::vector<Shift, Allocator<Shift>> mShifts;
+		uint64_t mRevision;
+	};
+
+	struct DiagnosticsWorker;
 
 	void ProcessInputs();
+	void UpdateDiagnosticsProvider();
 	void Colorize(int aFromLine = 0, int aCount = -1);
 	void ColorizeRange(int aFromLine = 0, int aToLine = 0);
 	void ColorizeInternal();
 	float TextDistanceToLineStart(const Coordinates& aFrom) const;
+	template <bool FixedPitch> float TextDistanceToLineStart(const Coordinates& aFrom) const;
+	template <bool FixedPitch> int ScreenPosToColumn(int aLine, float aX) const;
+	const LineLayout& GetLineLayout(int aLine) const;
+	const LineDrawing& GetLineDrawing(int aLine);
+	void PruneLineCaches(int aVisibleLines);
+	float MeasureLineWidth(int aLine) const;
+	void UpdateLineWidths();
+	void UpdateGutter();
+	const LineMarkers* GetLineMarkers(int aLine) const;
+	LineMarkers* EditLineMarkers(int aLine);
+	void ReleaseEmptyLineMarkers(int aLine);
+	void ReleaseLineMarkers(Line& aLine);
+	void MergeLineMarkers(int aFrom, int aInto);
+	uint32_t AllocateMarkerSlot();
+	void ReleaseMarkerSlot(uint32_t aSlot);
+	void DetachMarkers();
+	void AttachMarkers();
+	void RenderGutter(ImDrawList* aDrawList, float aLeft, int aFirstLine, int aLastLine);
+	void RenderDiagnostics(ImDrawList* aDrawList, float aLeft, int aFirstLine, int aLastLine, float aMinX, float aMaxX);
+	float GetLineScreenY(int aLine) const;
+	uint64_t GetStateSignature() const;
 	void EnsureCursorVisible();
+	void UpdateScroll();
+	void SetScrollY(double aScrollY);
+	double GetScrollRatio() const;
 	int GetPageSize() const;
 	std::string GetText(const Coordinates& aStart, const Coordinates& aEnd) const;
 	Coordinates GetActualCursorCoordinates() const;
@@ -325,7 +982,21 @@ private:
 	void Advance(Coordinates& aCoordinates) const;
 	void DeleteRange(const Coordinates& aStart, const Coordinates& aEnd);
 	int InsertTextAt(Coordinates& aWhere, const char* aValue);
+	void InsertTextInternal(const char* aValue);
+	void ContinueInsert(size_t aBytes);
+	void CancelInsert();
 	void AddUndo(UndoRecord& aValue);
+	bool MergeUndo(UndoRecord& aInto, const UndoRecord& aNext);
+	void ReleaseUndo(UndoRecord& aRecord);
+	void ClearUndo();
+	void ReplaceText(const std::string& aText);
+	void TrimUndo();
+	void DropUndoBranch(int aNode);
+	UndoRecord& GetUndoRecord(int aNode) { return mUndoBuffer[(size_t)(aNode - mUndoBase)]; }
+	const UndoRecord& GetUndoRecord(int aNode) const { return mUndoBuffer[(size_t)(aNode - mUndoBase)]; }
+	bool IsUndoNode(int aNode) const;
+	int& GetUndoRedoChild(int aNode) { return aNode == -1 ? mUndoRootRedoChild : GetUndoRecord(aNode).mRedoChild; }
+	Coordinates GetTextEnd(const Coordinates& aStart, const std::string& aText) const;
 	Coordinates ScreenPosToCoordinates(const ImVec2& aPosition) const;
 	Coordinates FindWordStart(const Coordinates& aFrom) const;
 	Coordinates FindWordEnd(const Coordinates& aFrom) const;
@@ -339,10 +1010,31 @@ private:
 	void RemoveLine(int aIndex);
 	Line& InsertLine(int aIndex);
 	void EnterCharacter(ImWchar aChar, bool aShift);
+	void EnterText(const std::string& aText);
 	void Backspace();
+	size_t GetCursors(Cursors& aCursors) const;
+	void SetCursors(const Cursors& aCursors, size_t aPrimary);
+	void InsertExtraCursor(const EditorState& aState);
+	void MergeCursors();
+	template <class Action> void ForEachCursor(Action aAction);
+	template <class Action> void EditCursors(Action aAction);
+	template <class Action> void EditLines(Action aAction);
+	void BeginLineEdit(UndoRecord& aRecord, int aFirst, int aEnd) const;
+	void EndLineEdit(UndoRecord& aRecord, int aFirst, int aEnd);
+	void MoveLines(int aFirst, LineOrder& aOrder);
+	void ReorderLines(int aFirst, const LineOrder& aOrder);
+	void SetLineTexts(int aFirst, const std::string& aText);
+	static void ShiftLinePositions(LinePositions aPositions, int aFirst, int aEnd, const std::vector<std::pair<int, int>>& aChanges);
+	bool FindNext(const std::string& aText, const Coordinates& aFrom, Coordinates& aStart, Coordinates& aEnd) const;
+	void FindMatches() const;
+	void FindMatches(int aFirstLine, int aEndLine, LinePosition aNext, FindMatchList& aMatches) const;
+	void UpdateFindMatches() const;
+	void InvalidateFindMatches(int aFirst, int aEnd);
+	void SelectFindMatch(const FindMatch& aMatch);
 	void DeleteSelection();
 	std::string GetWordUnderCursor() const;
 	std::string GetWordAt(const Coordinates& aCoords) const;
+	void GetWordAt(const Coordinates& aCoords, std::string& aResult) const;
 	ImU32 GetGlyphColor(const Glyph& aGlyph) const;
 
 	void HandleKeyboardInputs();
@@ -352,10 +1044,34 @@ private:
 	float mLineSpacing;
 	Lines mLines;
 	EditorState mState;
-	UndoBuffer mUndoBuffer;
-	int mUndoIndex;
+	Cursors mExtraCursors; // Besides mState, sorted and not overlapping
+	UndoBuffer mUndoBuffer; // The undo tree, in the order the nodes were added
+	UndoArena mUndoArena;
+	int mUndoBase; // Node id of mUndoBuffer.front()
+	int mUndoNode; // Where the text is in the undo tree
+	int mUndoRootRedoChild;
+	size_t mUndoMemory; // Estimated size of mUndoBuffer
+	size_t mUndoMemoryLimit;
+	double mUndoMergeInterval;
+	double mUndoMergeDeadline; // ImGui::GetTime() until which the last record accepts merging
+	std::string mUndoMergeText;
+	UndoRecord* mUndoBatch; // Collects the edits made at every cursor or within BeginEdit() and EndEdit()
+	bool mUndoJumping; // The lines to colorize are collected until the end of JumpToUndoNode()
+	int mUndoJumpColorFirst;
+	int mUndoJumpColorTail; // Lines before the end of the text
+	UndoRecord mEditRecord;
+	int mEditDepth;
+	size_t mInsertChunkSize;
+	std::string mInsertText; // Going in over several frames, see SetInsertChunkSize()
+	size_t mInsertOffset; // Bytes of mInsertText inserted so far
+	Coordinates mInsertWhere;
+	UndoRecord mInsertRecord; // Added once all of mInsertText is in, if mInsertUndo is set
+	bool mInsertUndo;
 
 	int mTabSize;
+	int mLineLengthLimit;
+	FontPitch mFontPitch;
+	bool mFixedPitch;
 	bool mOverwrite;
 	bool mReadOnly;
 	bool mWithinRender;
@@ -379,12 +1095,60 @@ private:
 	RegexList mRegexList;
 
 	bool mCheckComments;
-	Breakpoints mBreakpoints;
-	ErrorMarkers mErrorMarkers;
+	std::vector<LineMarkers, Allocator<LineMarkers>> mMarkerSlots; // Slot 0 is never used
+	std::vector<uint32_t, Allocator<uint32_t>> mFreeMarkerSlots;
+	std::map<int, uint32_t, std::less<int>, Allocator<std::pair<const int, uint32_t>>> mPendingMarkers; // Slots of lines past the end of the text
+	uint64_t mMarkersRevision; // Renewed by any marker change
 	ImVec2 mCharAdvance;
+	const GlyphAdvanceCache* mGlyphAdvances; // Refreshed at the beginning of every Render() call
+	std::shared_ptr<const GlyphAdvanceCache> mGlyphAdvancesOwner; // Keeps mGlyphAdvances alive
+	mutable LineLayouts mLineLayouts; // Keyed by line revision
+	LineDrawings mLineDrawings; // Keyed by line revision
+	uint64_t mPaletteRevision; // Renewed whenever the colors of glyphs may have changed without their line changing
+	LineWidthIndex mLineWidths;
+	mutable DiagnosticIndex mDiagnostics; // Queued line shifts are applied by const queries too
+	DiagnosticsProvider* mDiagnosticsProvider;
+	std::unique_ptr<DiagnosticsWorker> mDiagnosticsWorker;
+	double mDiagnosticsDebounce;
+	double mDiagnosticsDueTime; // When to hand the next snapshot to the provider, DBL_MAX if it is up to date
+	bool mDiagnosticsRunning;
+	uint64_t mTextVersion; // Counts the frames in which the text changed
+	uint64_t mTextRevision; // Counts the changes of the text
+	std::string mFindText;
+	bool mFindMatchCase;
+	mutable FindMatchList mFindMatches; // Sorted
+	mutable FindMatchList mFindChangedMatches; // Those found again in the changed lines, see UpdateFindMatches()
+	mutable uint64_t mFindRevision; // mTextRevision the matches were found at
+	mutable int mFindLineCount; // Lines of the text the matches were found in
+	mutable uint64_t mFindChangesRevision; // Last mTextRevision reported to InvalidateFindMatches()
+	mutable int mFindChangedFirst; // The lines changed since mFindRevision start at this line,
+	mutable int mFindUnchangedTail; // and end this many lines before the end of the text
+	Gutter mGutter;
+	const GlyphAdvanceCache* mLineWidthsAdvances; // Settings mLineWidths was measured with
+	int mLineWidthsTabSize;
+	int mLineWidthsLengthLimit;
 	Coordinates mInteractiveStart, mInteractiveEnd;
-	std::string mLineBuffer;
-	uint64_t mStartTime;
+	double mStartTime; // ImGui::GetTime() the cursor blink cycle started at
+	double mBlinkDeadline; // Next time the cursor blinks, DBL_MAX if no cursor was drawn
+	bool mScrollRequested; // Scrolling was requested during the last Render() and shows up in the next one
+
+	// Vertical scrolling is done on a double precision logical position, in pixels from the top of the document.
+	// ImGui only sees a content height bounded to keep float precision, with a scroll position mapped onto it.
+	double mScrollY;
+	float mImGuiScrollY; // Last scroll position handed to or read from ImGui
+	float mScrollHeight; // Content height handed to ImGui
+	float mContentTopY; // Screen position of the top of the window contents, whatever the scroll position
+	int mRenderedFirstLine, mRenderedLastLine;
+	uint64_t mRenderedStateSignature;
+	uint64_t mFrameSignature;
+	bool mFrameUnchanged;
 
 	float mLastClick;
+
+	// Scratch buffers kept across frames and colorization passes, so that they stop allocating once grown
+	std::vector<char, Allocator<char>> mColorizeBuffer;
+	std::vector<PaletteIndex, Allocator<PaletteIndex>> mColorizeColors;
+	std::match_results<const char*, Allocator<std::csub_match>> mColorizeMatch;
+	std::string mColorizeId;
+	std::string mHoveredWord;
 };
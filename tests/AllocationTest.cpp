@@ -0,0 +1,109 @@
+// Checks that frames without edits do not allocate once the visible lines were drawn.
+// Build with the ImGui sources, e.g. from the repository root:
+//   g++ -std=c++17 -I. -Iimgui tests/AllocationTest.cpp TextEditor.cpp imgui/imgui*.cpp -lpthread
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "TestFrame.h"
+
+// Also counts what does not go through TextEditor::SetAllocatorFunctions(): std::string members, std::regex
+// internals and ImGui itself when its allocator is left at the default
+static uint64_t sNewCount = 0;
+
+void* operator new(size_t aSize)
+{
+	++sNewCount;
+	if (void* ptr = malloc(aSize ? aSize : 1))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* aPtr) noexcept
+{
+	free(aPtr);
+}
+
+void operator delete(void* aPtr, size_t) noexcept
+{
+	free(aPtr);
+}
+
+static int sFailures = 0;
+
+static void Check(bool aCondition, const char* aWhat)
+{
+	if (!aCondition)
+	{
+		printf("FAILED: %s\n", aWhat);
+		++sFailures;
+	}
+}
+
+int main()
+{
+	TestFrame frame;
+
+	std::string text;
+	for (int i = 0; i < 500; ++i)
+	{
+		text += "float value" + std::to_string(i) + " = sin(x) * \t2.0; // comment \xc3\xa9\n";
+	}
+
+	TextEditor editor;
+	editor.SetLanguageDefinition(TextEditor::LanguageDefinition::GLSL());
+	editor.SetText(text);
+	editor.SetShowWhitespaces(true);
+	editor.SetErrorMarkers({ { 3, "error" } });
+	editor.SetBreakpoints({ 5 });
+	editor.SetFindText("value1", false);
+	editor.SetSelection(TextEditor::Coordinates(2, 4), TextEditor::Coordinates(4, 8));
+	ImGui::GetIO().MousePos = ImVec2(120.0f, 60.0f); // Over an identifier, for the hover lookup
+
+	// Colorizing and measuring the document are spread over frames
+	for (int i = 0; i < 200; ++i)
+	{
+		frame.Render(editor);
+	}
+
+	const uint64_t allocations = TextEditor::GetAllocationCount();
+	const int active = TextEditor::GetActiveAllocationCount();
+	uint64_t news = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		frame.Begin();
+		const uint64_t before = sNewCount;
+		editor.Render("Editor");
+		news += sNewCount - before;
+		frame.End();
+	}
+
+	printf("editor allocations %llu, active change %d, operator new calls %llu\n",
+		(unsigned long long)(TextEditor::GetAllocationCount() - allocations), TextEditor::GetActiveAllocationCount() - active,
+		(unsigned long long)news);
+	Check(TextEditor::GetAllocationCount() == allocations, "frames without edits allocate through the editor's hooks");
+	Check(TextEditor::GetActiveAllocationCount() == active, "frames without edits change the active allocations");
+	Check(news == 0, "frames without edits call operator new");
+
+	// One edit may allocate, after which frames are steady again
+	editor.SetCursorPosition(TextEditor::Coordinates(1, 0));
+	editor.InsertText("x");
+	for (int i = 0; i < 10; ++i)
+	{
+		frame.Render(editor);
+	}
+
+	const uint64_t afterEdit = TextEditor::GetAllocationCount();
+	for (int i = 0; i < 100; ++i)
+	{
+		frame.Render(editor);
+	}
+	Check(TextEditor::GetAllocationCount() == afterEdit, "frames after an edit keep allocating");
+
+	printf(sFailures ? "%d check(s) failed\n" : "all checks passed\n", sFailures);
+	return sFailures ? 1 : 0;
+}
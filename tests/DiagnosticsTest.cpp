@@ -0,0 +1,222 @@
+// Checks the diagnostics provider scheduling: debounce, cancellation of runs on outdated text, dropping of their
+// results, and RegexDiagnosticsProvider itself.
+// Build with the ImGui sources, e.g. from the repository root:
+//   g++ -std=c++17 -I. -Iimgui tests/DiagnosticsTest.cpp TextEditor.cpp imgui/imgui*.cpp -lpthread
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "TestFrame.h"
+
+typedef TextEditor::Coordinates Coordinates;
+
+// Reports the first line of the text as its only diagnostic. While closed, runs wait until the gate is opened or
+// they are cancelled, and return their result either way so that the editor has to drop outdated ones.
+class GatedProvider : public TextEditor::DiagnosticsProvider
+{
+public:
+	void Run(const TextEditor::DiagnosticsSnapshot& aSnapshot, const std::atomic<bool>& aCancelled, TextEditor::Diagnostics& aResult) override
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		++mRuns;
+		while (!mOpen && !aCancelled)
+		{
+			mCondition.wait_for(lock, std::chrono::milliseconds(1));
+		}
+		mCancelledRuns += aCancelled ? 1 : 0;
+
+		TextEditor::Diagnostic diagnostic;
+		diagnostic.mEnd = Coordinates(0, 1);
+		diagnostic.mMessage = aSnapshot.mLines.empty() ? std::string() : aSnapshot.mLines[0];
+		aResult.push_back(diagnostic);
+	}
+
+	void SetOpen(bool aOpen)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mOpen = aOpen;
+		mCondition.notify_all();
+	}
+
+	int GetRuns()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return mRuns;
+	}
+
+	int GetCancelledRuns()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return mCancelledRuns;
+	}
+
+private:
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	bool mOpen = true;
+	int mRuns = 0;
+	int mCancelledRuns = 0;
+};
+
+static int sFailures = 0;
+
+static void Check(bool aCondition, const char* aWhat)
+{
+	if (!aCondition)
+	{
+		printf("FAILED: %s\n", aWhat);
+		++sFailures;
+	}
+}
+
+// ImGui needs a positive delta time, this one keeps the debounce from running out while waiting for the worker
+static const float sPumpTime = 0.0001f;
+
+template <class Condition>
+static bool Pump(TestFrame& aFrame, TextEditor& aEditor, Condition aCondition)
+{
+	for (int i = 0; i < 2000; ++i)
+	{
+		aFrame.Render(aEditor, sPumpTime);
+		if (aCondition())
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+// Gives the worker time to pick up a snapshot that it should not have been handed
+static void Settle(TestFrame& aFrame, TextEditor& aEditor)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	aFrame.Render(aEditor, sPumpTime);
+}
+
+static bool HasMessage(const TextEditor& aEditor, const std::string& aMessage)
+{
+	auto& diagnostics = aEditor.GetDiagnostics();
+	return diagnostics.size() == 1 && diagnostics[0].mMessage == aMessage;
+}
+
+static void TestRegexProvider()
+{
+	TextEditor::RegexDiagnosticsProvider provider;
+	provider.AddRule("TODO", TextEditor::DiagnosticSeverity::Info, "todo");
+
+	TextEditor::DiagnosticsSnapshot snapshot;
+	snapshot.mLines = { "foo TODO", "\tTODO \xc3\xa9 TODO" };
+	snapshot.mTabSize = 4;
+
+	std::atomic<bool> cancelled(false);
+	TextEditor::Diagnostics result;
+	provider.Run(snapshot, cancelled, result);
+	Check(result.size() == 3, "regex provider finds every match");
+	if (result.size() == 3)
+	{
+		Check(result[0].mStart == Coordinates(0, 4) && result[0].mEnd == Coordinates(0, 8), "regex match columns");
+		Check(result[1].mStart == Coordinates(1, 4) && result[1].mEnd == Coordinates(1, 8), "regex match columns after a tab");
+		Check(result[2].mStart == Coordinates(1, 11) && result[2].mEnd == Coordinates(1, 15), "regex match columns after UTF-8");
+		Check(result[2].mSeverity == TextEditor::DiagnosticSeverity::Info && result[2].mMessage == "todo", "regex rule severity and message");
+	}
+
+	cancelled = true;
+	result.clear();
+	provider.Run(snapshot, cancelled, result);
+	Check(result.empty(), "regex provider stops once cancelled");
+}
+
+static void TestDebounce(TestFrame& aFrame)
+{
+	GatedProvider provider;
+	TextEditor editor;
+	editor.SetText("first");
+	editor.SetDiagnosticsProvider(&provider, 0.5);
+
+	Check(Pump(aFrame, editor, [&] { return HasMessage(editor, "first"); }), "the text is checked right after setting a provider");
+	Check(provider.GetRuns() == 1, "one run for the initial text");
+
+	// Typing faster than the debounce never starts a run
+	editor.SetCursorPosition(Coordinates(0, 0));
+	for (int i = 0; i < 10; ++i)
+	{
+		editor.InsertText("x");
+		aFrame.Render(editor, 0.1f);
+	}
+	aFrame.Render(editor, 0.2f);
+	aFrame.Render(editor, 0.2f);
+	Settle(aFrame, editor);
+	Check(provider.GetRuns() == 1, "no run before the text was left unchanged for the debounce time");
+	Check(HasMessage(editor, "first"), "diagnostics are kept until the next result");
+
+	aFrame.Render(editor, 0.2f);
+	Check(Pump(aFrame, editor, [&] { return HasMessage(editor, "xxxxxxxxxxfirst"); }), "one run on the latest text after the debounce");
+	Check(provider.GetRuns() == 2, "edits within the debounce time start a single run");
+
+	// A result is applied once: diagnostics cleared by the host stay cleared
+	editor.ClearDiagnostics();
+	Settle(aFrame, editor);
+	Check(editor.GetDiagnostics().empty(), "a result is only taken once");
+
+	editor.SetDiagnosticsProvider(nullptr);
+}
+
+static void TestCancellation(TestFrame& aFrame)
+{
+	GatedProvider provider;
+	TextEditor editor;
+	editor.SetText("first");
+	editor.SetDiagnosticsProvider(&provider, 0.0);
+	Check(Pump(aFrame, editor, [&] { return HasMessage(editor, "first"); }), "initial result");
+
+	// Edit, and hold the run on the new text
+	provider.SetOpen(false);
+	editor.SetCursorPosition(Coordinates(0, 0));
+	editor.InsertText("a");
+	Check(Pump(aFrame, editor, [&] { return provider.GetRuns() == 2; }), "an edit starts a new run");
+
+	// Editing again cancels it, and its result must not replace the diagnostics
+	editor.InsertText("b");
+	aFrame.Render(editor, sPumpTime);
+	Check(Pump(aFrame, editor, [&] { return provider.GetCancelledRuns() == 1; }), "an edit cancels the run in progress");
+	provider.SetOpen(true);
+	Check(Pump(aFrame, editor, [&] { return HasMessage(editor, "abfirst"); }), "the run on the latest text is applied");
+	Check(provider.GetRuns() == 3, "one run per posted version");
+
+	// A cancelled run that finishes after the next one was posted is dropped as well
+	provider.SetOpen(false);
+	editor.InsertText("c");
+	Check(Pump(aFrame, editor, [&] { return provider.GetRuns() == 4; }), "run on abc");
+	editor.InsertText("d");
+	Check(Pump(aFrame, editor, [&] { return provider.GetCancelledRuns() == 2; }), "run on abc cancelled");
+	provider.SetOpen(true);
+	Check(Pump(aFrame, editor, [&] { return HasMessage(editor, "abcdfirst"); }), "the run on abcd is applied");
+	Settle(aFrame, editor);
+	Check(HasMessage(editor, "abcdfirst"), "the cancelled result does not come back");
+
+	// Removing the provider cancels a run in progress and waits for it
+	provider.SetOpen(false);
+	editor.InsertText("e");
+	Check(Pump(aFrame, editor, [&] { return provider.GetRuns() == 6; }), "run on abcde");
+	editor.SetDiagnosticsProvider(nullptr);
+	Check(provider.GetCancelledRuns() == 3, "removing the provider cancels its run");
+	Settle(aFrame, editor);
+	Check(HasMessage(editor, "abcdfirst"), "no result after the provider was removed");
+}
+
+int main()
+{
+	TestFrame frame;
+
+	TestRegexProvider();
+	TestDebounce(frame);
+	TestCancellation(frame);
+
+	printf(sFailures ? "%d check(s) failed\n" : "all checks passed\n", sFailures);
+	return sFailures ? 1 : 0;
+}
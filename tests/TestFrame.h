@@ -0,0 +1,49 @@
+#pragma once
+#include "imgui.h"
+#include "TextEditor.h"
+
+// Minimal headless ImGui setup for the checks in this directory: no backend, the font atlas is built but never
+// uploaded, and every frame draws one editor in a fixed window.
+class TestFrame
+{
+public:
+	TestFrame()
+	{
+		ImGui::CreateContext();
+		auto& io = ImGui::GetIO();
+		io.DisplaySize = ImVec2(1280.0f, 720.0f);
+		io.IniFilename = nullptr;
+
+		unsigned char* pixels;
+		int width, height;
+		io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+	}
+
+	~TestFrame()
+	{
+		ImGui::DestroyContext();
+	}
+
+	// Advances ImGui::GetTime() by aDeltaTime, which is all the editor's debounce and blinking go by
+	void Begin(float aDeltaTime = 1.0f / 60.0f)
+	{
+		ImGui::GetIO().DeltaTime = aDeltaTime;
+		ImGui::NewFrame();
+		ImGui::SetNextWindowPos(ImVec2(0.0f, 0.0f));
+		ImGui::SetNextWindowSize(ImGui::GetIO().DisplaySize);
+		ImGui::Begin("Test");
+	}
+
+	void End()
+	{
+		ImGui::End();
+		ImGui::Render();
+	}
+
+	void Render(TextEditor& aEditor, float aDeltaTime = 1.0f / 60.0f)
+	{
+		Begin(aDeltaTime);
+		aEditor.Render("Editor");
+		End();
+	}
+};